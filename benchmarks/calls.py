@@ -0,0 +1,49 @@
+"""
+Measure the per-call overhead of the Encoder and Decoder methods.
+
+The headers are kept tiny so that the time is dominated by the cost of
+calling into the extension and unpacking the arguments. Run this against two
+builds of pylsqpack to compare them:
+
+    python benchmarks/calls.py
+"""
+
+import argparse
+import timeit
+
+from pylsqpack import Decoder, Encoder
+
+HEADERS = [(b":method", b"GET")]
+
+
+def make_cases():
+    encoder = Encoder()
+    decoder = Decoder(0x100, 0x10)
+    _, data = encoder.encode(0, HEADERS)
+
+    return {
+        "encode": lambda: encoder.encode(0, HEADERS),
+        "encode (keywords)": lambda: encoder.encode(stream_id=0, headers=HEADERS),
+        "feed_decoder": lambda: encoder.feed_decoder(b""),
+        "feed_encoder": lambda: decoder.feed_encoder(b""),
+        "feed_header": lambda: decoder.feed_header(0, data),
+        "feed_header (keywords)": lambda: decoder.feed_header(stream_id=0, data=data),
+        "cancel_stream": lambda: decoder.cancel_stream(0),
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument(
+        "--number", type=int, default=200000, help="calls per measurement"
+    )
+    parser.add_argument("--repeat", type=int, default=5, help="measurements per method")
+    args = parser.parse_args()
+
+    for name, func in make_cases().items():
+        best = min(timeit.repeat(func, number=args.number, repeat=args.repeat))
+        print("%-24s %8.1f ns/call" % (name, best / args.number * 1e9))
+
+
+if __name__ == "__main__":
+    main()
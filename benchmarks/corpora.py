@@ -0,0 +1,143 @@
+"""
+Synthetic but realistic HTTP/3 header corpora.
+
+Each corpus is a list of header lists, generated from a fixed seed so that
+runs are comparable. The values mimic the repetition found in real traffic:
+most headers repeat from one request to the next, while a few (paths,
+request IDs, dates, lengths) change every time.
+"""
+
+import random
+
+AUTHORITIES = [b"www.example.com", b"static.example.com", b"api.example.com"]
+
+USER_AGENTS = [
+    b"Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 "
+    b"(KHTML, like Gecko) Chrome/124.0.0.0 Safari/537.36",
+    b"Mozilla/5.0 (Macintosh; Intel Mac OS X 14_4) AppleWebKit/605.1.15 "
+    b"(KHTML, like Gecko) Version/17.4 Safari/605.1.15",
+    b"Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0",
+]
+
+ACCEPTS = {
+    b"document": b"text/html,application/xhtml+xml,application/xml;q=0.9,"
+    b"image/avif,image/webp,*/*;q=0.8",
+    b"script": b"*/*",
+    b"style": b"text/css,*/*;q=0.1",
+    b"image": b"image/avif,image/webp,image/apng,image/*,*/*;q=0.8",
+}
+
+CONTENT_TYPES = {
+    b"document": b"text/html; charset=utf-8",
+    b"script": b"application/javascript",
+    b"style": b"text/css",
+    b"image": b"image/webp",
+}
+
+EXTENSIONS = {b"script": b"js", b"style": b"css", b"image": b"webp"}
+
+DATE = b"Mon, 13 May 2024 09:%02d:%02d GMT"
+
+
+def _hex(rng, length):
+    return b"%0*x" % (length, rng.getrandbits(length * 4))
+
+
+def browser_requests(count, seed=0):
+    """
+    Page loads from a handful of browsers: a document followed by its
+    subresources, with cookies and fetch metadata.
+    """
+    rng = random.Random(seed)
+    corpus = []
+    while len(corpus) < count:
+        user_agent = rng.choice(USER_AGENTS)
+        cookie = b"session=%s; _ga=GA1.2.%d.%d; theme=dark" % (
+            _hex(rng, 32),
+            rng.randrange(10**9),
+            rng.randrange(10**9),
+        )
+        page = b"/articles/%d" % rng.randrange(10000)
+        for i in range(rng.randrange(5, 30)):
+            dest = b"document" if i == 0 else rng.choice(list(ACCEPTS)[1:])
+            path = (
+                page if i == 0 else b"/assets/%s.%s" % (_hex(rng, 8), EXTENSIONS[dest])
+            )
+            headers = [
+                (b":method", b"GET"),
+                (b":scheme", b"https"),
+                (b":authority", AUTHORITIES[0] if i == 0 else AUTHORITIES[1]),
+                (b":path", path),
+                (b"user-agent", user_agent),
+                (b"accept", ACCEPTS[dest]),
+                (b"accept-encoding", b"gzip, deflate, br, zstd"),
+                (b"accept-language", b"en-US,en;q=0.9,fr;q=0.8"),
+                (b"sec-fetch-dest", dest),
+                (b"sec-fetch-mode", b"navigate" if i == 0 else b"no-cors"),
+                (b"sec-fetch-site", b"none" if i == 0 else b"same-site"),
+            ]
+            if i:
+                headers.append((b"referer", b"https://www.example.com" + page))
+            headers.append((b"cookie", cookie))
+            corpus.append(headers)
+    return corpus[:count]
+
+
+def api_responses(count, seed=0):
+    """
+    JSON API responses with per-request IDs, dates and lengths.
+    """
+    rng = random.Random(seed)
+    corpus = []
+    for i in range(count):
+        status = rng.choices([b"200", b"201", b"404", b"500"], [90, 5, 4, 1])[0]
+        corpus.append(
+            [
+                (b":status", status),
+                (b"content-type", b"application/json"),
+                (b"content-length", b"%d" % rng.randrange(2, 50000)),
+                (b"date", DATE % divmod(i // 10 % 3600, 60)),
+                (b"server", b"envoy"),
+                (b"cache-control", b"no-store"),
+                (b"x-request-id", _hex(rng, 32)),
+                (b"x-envoy-upstream-service-time", b"%d" % rng.randrange(1, 300)),
+                (b"vary", b"accept-encoding"),
+                (b"strict-transport-security", b"max-age=31536000"),
+            ]
+        )
+    return corpus
+
+
+def cdn_responses(count, seed=0):
+    """
+    Static assets served from a CDN cache, with cache status headers.
+    """
+    rng = random.Random(seed)
+    corpus = []
+    for i in range(count):
+        kind = rng.choice(list(CONTENT_TYPES)[1:])
+        hit = rng.random() < 0.85
+        corpus.append(
+            [
+                (b":status", b"200"),
+                (b"content-type", CONTENT_TYPES[kind]),
+                (b"content-length", b"%d" % rng.randrange(500, 500000)),
+                (b"date", DATE % divmod(i // 10 % 3600, 60)),
+                (b"last-modified", b"Tue, 02 Apr 2024 16:%02d:00 GMT" % (i % 60)),
+                (b"etag", b'"%s"' % _hex(rng, 16)),
+                (b"cache-control", b"public, max-age=31536000, immutable"),
+                (b"age", b"%d" % rng.randrange(86400) if hit else b"0"),
+                (b"x-cache", b"HIT" if hit else b"MISS"),
+                (b"via", b"1.1 varnish, 1.1 cdn-edge-%d" % rng.randrange(20)),
+                (b"accept-ranges", b"bytes"),
+                (b"access-control-allow-origin", b"*"),
+            ]
+        )
+    return corpus
+
+
+CORPORA = {
+    "browser-requests": browser_requests,
+    "api-responses": api_responses,
+    "cdn-responses": cdn_responses,
+}
@@ -0,0 +1,184 @@
+"""
+Measure the throughput of QPACK compression on realistic header corpora.
+
+Each corpus is replayed through Encoder.encode, Decoder.feed_encoder and
+Decoder.feed_header for several table sizes and blocked stream settings.
+When blocked streams are allowed, the header block is delivered before the
+encoder stream data, so that blocked streams are resumed with
+Decoder.resume_header.
+
+The results can be written as JSON and compared against a baseline:
+
+    python benchmarks/run.py --output baseline.json
+    python benchmarks/run.py --compare baseline.json
+"""
+
+import argparse
+import json
+import platform
+import sys
+import time
+
+from corpora import CORPORA
+
+import pylsqpack
+from pylsqpack import Decoder, Encoder, StreamBlocked
+
+TABLE_CAPACITIES = [0, 4096, 16384]
+BLOCKED_STREAMS = [0, 16]
+
+
+def replay(corpus, table_capacity, blocked_streams):
+    """
+    Replay a corpus through an encoder and a decoder, and return the
+    elapsed time and the encoder's statistics.
+    """
+    encoder = Encoder()
+    decoder = Decoder(table_capacity, blocked_streams)
+    encoder.apply_settings(table_capacity, blocked_streams)
+
+    start = time.perf_counter()
+    for i, headers in enumerate(corpus):
+        stream_id = i * 4
+        control, data = encoder.encode(stream_id, headers)
+        if blocked_streams:
+            try:
+                decoder_control, decoded = decoder.feed_header(stream_id, data)
+            except StreamBlocked:
+                for unblocked_id in decoder.feed_encoder(control):
+                    decoder_control, decoded = decoder.resume_header(unblocked_id)
+            else:
+                decoder.feed_encoder(control)
+        else:
+            decoder.feed_encoder(control)
+            decoder_control, decoded = decoder.feed_header(stream_id, data)
+        encoder.feed_decoder(decoder_control)
+    elapsed = time.perf_counter() - start
+
+    assert decoded == headers, "the last header list did not round-trip"
+    return elapsed, encoder.stats()
+
+
+def run_scenario(corpus, table_capacity, blocked_streams, repeat):
+    header_count = sum(len(headers) for headers in corpus)
+    header_bytes = sum(len(n) + len(v) for headers in corpus for n, v in headers)
+
+    # Keep the fastest run, which is the least disturbed by other processes.
+    elapsed = float("inf")
+    for _ in range(repeat):
+        blocks_before = sys.getallocatedblocks()
+        run_elapsed, stats = replay(corpus, table_capacity, blocked_streams)
+        blocks_after = sys.getallocatedblocks()
+        elapsed = min(elapsed, run_elapsed)
+
+    compressed = stats["header_block_bytes"] + stats["encoder_stream_bytes"]
+    return {
+        "table_capacity": table_capacity,
+        "blocked_streams": blocked_streams,
+        "header_lists": len(corpus),
+        "headers": header_count,
+        "headers_per_sec": header_count / elapsed,
+        "bytes_per_sec": header_bytes / elapsed,
+        # Memory blocks still allocated after a run, which should stay close
+        # to zero unless something leaks.
+        "retained_blocks_per_header": (blocks_after - blocks_before) / header_count,
+        "compression_ratio": compressed / header_bytes,
+        "at_risk": stats["at_risk"],
+    }
+
+
+def compare(results, baseline, threshold):
+    """
+    Print the throughput changes against a baseline and return the number
+    of regressions beyond `threshold`.
+    """
+
+    def key(result):
+        return (result["corpus"], result["table_capacity"], result["blocked_streams"])
+
+    previous = {key(result): result for result in baseline["results"]}
+    regressions = 0
+    for result in results:
+        old = previous.get(key(result))
+        if old is None:
+            continue
+        change = result["headers_per_sec"] / old["headers_per_sec"] - 1
+        regressed = change < -threshold
+        regressions += regressed
+        print(
+            "%-18s %6d %3d %+7.1f%%%s"
+            % (key(result) + (change * 100, "  REGRESSION" if regressed else ""))
+        )
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument(
+        "--corpus", action="append", choices=CORPORA, help="corpora to run"
+    )
+    parser.add_argument(
+        "--count", type=int, default=2000, help="header lists per corpus"
+    )
+    parser.add_argument("--repeat", type=int, default=5, help="runs per scenario")
+    parser.add_argument("--output", help="write the results as JSON to this file")
+    parser.add_argument("--compare", help="compare with results from a JSON file")
+    parser.add_argument(
+        "--threshold",
+        type=float,
+        default=0.1,
+        help="the slowdown which counts as a regression (default: 0.1)",
+    )
+    args = parser.parse_args()
+
+    results = []
+    print(
+        "%-18s %6s %3s %12s %10s %8s %8s"
+        % ("corpus", "table", "blk", "headers/s", "MB/s", "ratio", "blocks/h")
+    )
+    for name in args.corpus or CORPORA:
+        corpus = CORPORA[name](args.count)
+        for table_capacity in TABLE_CAPACITIES:
+            for blocked_streams in BLOCKED_STREAMS:
+                if blocked_streams and not table_capacity:
+                    continue
+                result = {"corpus": name}
+                result.update(
+                    run_scenario(corpus, table_capacity, blocked_streams, args.repeat)
+                )
+                results.append(result)
+                print(
+                    "%-18s %6d %3d %12.0f %10.2f %8.3f %8.3f"
+                    % (
+                        name,
+                        table_capacity,
+                        blocked_streams,
+                        result["headers_per_sec"],
+                        result["bytes_per_sec"] / 1e6,
+                        result["compression_ratio"],
+                        result["retained_blocks_per_header"],
+                    )
+                )
+
+    report = {
+        "pylsqpack": pylsqpack.__version__,
+        "python": platform.python_version(),
+        "implementation": platform.python_implementation(),
+        "machine": platform.machine(),
+        "count": args.count,
+        "results": results,
+    }
+    if args.output:
+        with open(args.output, "w") as fp:
+            json.dump(report, fp, indent=2)
+
+    if args.compare:
+        with open(args.compare) as fp:
+            baseline = json.load(fp)
+        print()
+        if compare(results, baseline, args.threshold):
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
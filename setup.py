@@ -1,5 +1,6 @@
 import os.path
 import sys
+import sysconfig
 
 import setuptools
 from wheel.bdist_wheel import bdist_wheel
@@ -14,12 +15,16 @@ if sys.platform == "win32":
 else:
     extra_compile_args = ["-std=c99"]
 
+# The limited API is not available on free-threaded builds.
+py_limited_api = not sysconfig.get_config_var("Py_GIL_DISABLED")
+define_macros = [("Py_LIMITED_API", "0x030A0000")] if py_limited_api else []
+
 
 class bdist_wheel_abi3(bdist_wheel):
     def get_tag(self):
         python, abi, plat = super().get_tag()
 
-        if python.startswith("cp"):
+        if python.startswith("cp") and py_limited_api:
             return "cp310", "abi3", plat
 
         return python, abi, plat
@@ -29,10 +34,10 @@ setuptools.setup(
     ext_modules=[
         setuptools.Extension(
             "pylsqpack._binding",
-            define_macros=[("Py_LIMITED_API", "0x030A0000")],
+            define_macros=define_macros,
             extra_compile_args=extra_compile_args,
             include_dirs=include_dirs,
-            py_limited_api=True,
+            py_limited_api=py_limited_api,
             sources=[
                 "src/pylsqpack/binding.c",
                 "vendor/ls-qpack/lsqpack.c",
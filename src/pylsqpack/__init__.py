@@ -1,11 +1,18 @@
 # flake8: noqa
 
 from ._binding import (
+    NEVER_INDEX,
+    NO_DYNAMIC,
+    NO_HISTORY,
+    NO_INDEX,
     Decoder,
     DecoderStreamError,
     DecompressionFailed,
     Encoder,
     EncoderStreamError,
+    HeaderList,
+    HeaderName,
+    HeaderValidationError,
     StreamBlocked,
 )
 
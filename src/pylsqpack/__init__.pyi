@@ -1,21 +1,113 @@
-from typing import List, Tuple
+from typing import (
+    Callable,
+    Dict,
+    List,
+    Literal,
+    Optional,
+    Sequence,
+    Tuple,
+    Union,
+    overload,
+)
 
 Headers = List[Tuple[bytes, bytes]]
 
+NEVER_INDEX: int
+NO_DYNAMIC: int
+NO_HISTORY: int
+NO_INDEX: int
+
 class DecompressionFailed(Exception): ...
 class DecoderStreamError(Exception): ...
 class EncoderStreamError(Exception): ...
+class HeaderValidationError(ValueError): ...
 class StreamBlocked(Exception): ...
 
+class HeaderList(Sequence[Tuple[bytes, bytes]]):
+    def __len__(self) -> int: ...
+    @overload
+    def __getitem__(self, index: int) -> Tuple[bytes, bytes]: ...
+    @overload
+    def __getitem__(self, index: slice) -> List[Tuple[bytes, bytes]]: ...
+
+class HeaderName:
+    name: bytes
+    def __init__(self, name: Union[bytes, bytearray, memoryview, str]) -> None: ...
+
+BytesLike = Union[bytes, bytearray, memoryview]
+
+# The decoded headers are a HeaderList with lazy_headers, and a
+# (pseudo_headers, fields) tuple with http1_headers.
+DecodedHeaders = Union[Headers, HeaderList, Tuple[Headers, bytes]]
+
+EncoderHeaders = List[Tuple[Union[bytes, HeaderName], bytes]]
+
 class Decoder:
-    def __init__(self, max_table_capacity: int, blocked_streams: int) -> None: ...
-    def feed_encoder(self, data: bytes) -> List[int]: ...
-    def feed_header(self, stream_id: int, data: bytes) -> Tuple[bytes, Headers]: ...
-    def resume_header(self, stream_id: int) -> Tuple[bytes, Headers]: ...
+    def __init__(
+        self,
+        max_table_capacity: int,
+        blocked_streams: int,
+        *,
+        lazy_headers: bool = False,
+        sink: Optional[Callable[[int, bytes, DecodedHeaders], None]] = None,
+        coalesce_decoder_stream: bool = False,
+        http1_headers: bool = False,
+        validate_headers: bool = False,
+    ) -> None: ...
+    def cancel_stream(self, stream_id: int) -> bytes: ...
+    def feed_encoder(self, data: BytesLike) -> List[int]: ...
+    # None is returned if the decoder has a sink.
+    def feed_header(
+        self, stream_id: int, data: BytesLike
+    ) -> Optional[Tuple[bytes, DecodedHeaders]]: ...
+    # None is also returned until the last chunk.
+    def feed_header_chunk(
+        self, stream_id: int, data: BytesLike, header_size: int
+    ) -> Optional[Tuple[bytes, DecodedHeaders]]: ...
+    def flush_decoder_stream(self) -> bytes: ...
+    def memory_usage(self) -> int: ...
+    def resume_header(self, stream_id: int) -> Tuple[bytes, DecodedHeaders]: ...
+    def stats(self) -> Dict[str, Union[int, float]]: ...
 
 class Encoder:
     def apply_settings(
-        self, max_table_capacity: int, blocked_streams: int
+        self,
+        max_table_capacity: int,
+        blocked_streams: int,
+        *,
+        dynamic_table_capacity: Optional[int] = None,
+        aggressive_indexing: bool = False,
+    ) -> bytes: ...
+    def cancel_stream(self, stream_id: int) -> None: ...
+    @overload
+    def encode(
+        self,
+        stream_id: int,
+        headers: EncoderHeaders,
+        *,
+        allow_blocking: bool = True,
+        report_at_risk: Literal[False] = False,
+        validate_headers: bool = False,
+    ) -> Tuple[bytes, bytes]: ...
+    @overload
+    def encode(
+        self,
+        stream_id: int,
+        headers: EncoderHeaders,
+        *,
+        allow_blocking: bool = True,
+        report_at_risk: Literal[True],
+        validate_headers: bool = False,
+    ) -> Tuple[bytes, bytes, bool]: ...
+    def encode_many(
+        self, items: List[Tuple[int, EncoderHeaders]], *, allow_blocking: bool = True
+    ) -> Tuple[bytes, List[bytes]]: ...
+    def feed_decoder(self, data: BytesLike) -> None: ...
+    def memory_usage(self) -> int: ...
+    def prime(
+        self,
+        headers: EncoderHeaders,
     ) -> bytes: ...
-    def encode(self, stream_id: int, headers: Headers) -> Tuple[bytes, bytes]: ...
-    def feed_decoder(self, data: bytes) -> None: ...
+    def set_header_flags(self, name: bytes, flags: int) -> None: ...
+    def set_max_capacity(self, capacity: int) -> bytes: ...
+    def stats(self) -> Dict[str, Union[int, float]]: ...
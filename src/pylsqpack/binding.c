@@ -3,83 +3,800 @@
 #include <assert.h>
 
 #include <Python.h>
+#include <structmember.h>
 #include "lsqpack.h"
 #include "lsxpack_header.h"
+#include "xxhash.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define VALIDATION_SSE2
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define VALIDATION_NEON
+#endif
 
 #define MODULE_NAME "pylsqpack._binding"
 
-#define DEC_BUF_SZ 4096
+// Large enough for any decoder stream instruction emitted for one stream.
+#define DEC_BUF_SZ 16
 #define ENC_BUF_SZ 4096
 #define HDR_BUF_SZ 4096
 #define XHDR_BUF_SZ 4096
 #define PREFIX_MAX_SIZE 16
 
+// In addition to ls-qpack's `enum lsqpack_enc_flags`, request a
+// "never indexed" literal representation.
+#define ENC_FLAG_NEVER_INDEX (1 << 7)
+#define ENC_FLAGS_MASK (LQEF_NO_INDEX | LQEF_NO_HIST_UPD | LQEF_NO_DYN | ENC_FLAG_NEVER_INDEX)
+
 static PyObject *DecompressionFailed;
 static PyObject *DecoderStreamError;
 static PyObject *DecoderType;
 static PyObject *EncoderStreamError;
 static PyObject *EncoderType;
+static PyObject *HeaderListType;
+static PyObject *HeaderNameType;
+static PyObject *HeaderValidationError;
 static PyObject *StreamBlocked;
 
+/**
+ * Grow a buffer so that it holds at least `size` bytes.
+ *
+ * The buffer's size is doubled until it is large enough, so that repeated
+ * calls only reallocate a logarithmic number of times. This does not set a
+ * Python exception on failure, so it can be used from ls-qpack callbacks.
+ */
+static int buffer_reserve(unsigned char **buf, size_t *buf_sz, size_t size)
+{
+    size_t new_sz = *buf_sz ? *buf_sz : size;
+    unsigned char *new_buf;
+
+    if (size <= *buf_sz)
+        return 0;
+
+    while (new_sz < size) {
+        if (new_sz > SIZE_MAX / 2)
+            return -1;
+        new_sz *= 2;
+    }
+
+    new_buf = realloc(*buf, new_sz);
+    if (!new_buf)
+        return -1;
+    *buf = new_buf;
+    *buf_sz = new_sz;
+    return 0;
+}
+
+/**
+ * Encode an integer with an N-bit prefix, see RFC 7541 Section 5.1.
+ *
+ * `first` holds the bits of the first byte above the prefix. The buffer
+ * must hold at least PREFIX_INT_MAX_SIZE bytes.
+ */
+#define PREFIX_INT_MAX_SIZE 11
+
+static size_t encode_prefix_int(unsigned char *buf, unsigned char first, unsigned prefix_bits, uint64_t value)
+{
+    const uint64_t max = (1u << prefix_bits) - 1;
+    size_t len = 0;
+
+    if (value < max) {
+        buf[len++] = first | (unsigned char)value;
+        return len;
+    }
+    buf[len++] = first | (unsigned char)max;
+    value -= max;
+    while (value >= 0x80) {
+        buf[len++] = 0x80 | (value & 0x7f);
+        value >>= 7;
+    }
+    buf[len++] = (unsigned char)value;
+    return len;
+}
+
+// THREADING
+
+// Each Encoder and Decoder has its own lock, which is held for the duration
+// of a method call. If the lock is busy, the GIL is released while waiting
+// for it, as the thread holding the lock may need the GIL to make progress.
+#define ACQUIRE_LOCK(obj) do { \
+    if (!PyThread_acquire_lock((obj)->lock, NOWAIT_LOCK)) { \
+        Py_BEGIN_ALLOW_THREADS \
+        PyThread_acquire_lock((obj)->lock, WAIT_LOCK); \
+        Py_END_ALLOW_THREADS \
+    } } while (0)
+#define RELEASE_LOCK(obj) PyThread_release_lock((obj)->lock)
+
+// As in hashlib, only release the GIL when there is enough data for the
+// work to outweigh the cost of reacquiring it.
+#define GIL_MINSIZE 2048
+
+/**
+ * Release the GIL if `size` bytes are worth processing without it.
+ *
+ * The returned state must be passed to `gil_restore`.
+ */
+static PyThreadState *gil_release(size_t size)
+{
+    return size >= GIL_MINSIZE ? PyEval_SaveThread() : NULL;
+}
+
+static void gil_restore(PyThreadState *state)
+{
+    if (state)
+        PyEval_RestoreThread(state);
+}
+
+// The list iteration in the encoder needs a critical section on free-threaded
+// builds, where other threads may mutate the list concurrently.
+#ifdef Py_GIL_DISABLED
+#define BEGIN_CRITICAL_SECTION(op) Py_BEGIN_CRITICAL_SECTION(op)
+#define END_CRITICAL_SECTION() Py_END_CRITICAL_SECTION()
+#else
+#define BEGIN_CRITICAL_SECTION(op) {
+#define END_CRITICAL_SECTION() }
+#endif
+
+// ARGUMENTS
+
+// The methods use the METH_FASTCALL | METH_KEYWORDS calling convention, and
+// unpack their arguments by hand instead of through a format string, as
+// they are called at least once per HTTP request.
+
+/**
+ * Unpack the arguments of a method into `values`.
+ *
+ * `values` receives a borrowed reference, or NULL if it was not given, for
+ * each name in `kwlist`. The first `n_required` arguments are required, and
+ * the arguments after the first `n_positional` can only be passed by keyword.
+ */
+static int
+parse_args(const char *fname, const char *const *kwlist, Py_ssize_t n_positional, Py_ssize_t n_required,
+           PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames, PyObject **values)
+{
+    Py_ssize_t n_params = 0, n_kwargs, i;
+    PyObject *key;
+
+    while (kwlist[n_params])
+        n_params++;
+
+    if (nargs > n_positional) {
+        PyErr_Format(PyExc_TypeError, "%s() takes at most %zd positional arguments (%zd given)",
+                     fname, n_positional, nargs);
+        return -1;
+    }
+    for (i = 0; i < n_params; ++i)
+        values[i] = i < nargs ? args[i] : NULL;
+
+    n_kwargs = kwnames ? PyTuple_Size(kwnames) : 0;
+    for (Py_ssize_t k = 0; k < n_kwargs; ++k) {
+        key = PyTuple_GetItem(kwnames, k);
+        for (i = 0; i < n_params; ++i) {
+            if (PyUnicode_CompareWithASCIIString(key, kwlist[i]) == 0)
+                break;
+        }
+        if (i == n_params) {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", fname, key);
+            return -1;
+        }
+        if (values[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() got multiple values for argument '%s'", fname, kwlist[i]);
+            return -1;
+        }
+        values[i] = args[nargs + k];
+    }
+
+    for (i = 0; i < n_required; ++i) {
+        if (!values[i]) {
+            PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s' (pos %zd)",
+                         fname, kwlist[i], i + 1);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Convert an argument to an unsigned integer, without overflow checking
+ * like the "K" and "I" formats.
+ */
+static int
+parse_uint64(PyObject *obj, const char *name, uint64_t *value)
+{
+    if (!PyLong_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "%s must be an integer", name);
+        return -1;
+    }
+    *value = PyLong_AsUnsignedLongLongMask(obj);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+/**
+ * Convert an argument to an unsigned int, raising OverflowError if it is
+ * negative or too large, as the table settings must not wrap around.
+ */
+static int
+parse_uint(PyObject *obj, const char *name, unsigned *value)
+{
+    unsigned long long v;
+
+    if (!PyLong_Check(obj)) {
+        PyErr_Format(PyExc_TypeError, "%s must be an integer", name);
+        return -1;
+    }
+    v = PyLong_AsUnsignedLongLong(obj);
+    if (v == (unsigned long long)-1 && PyErr_Occurred())
+        return -1;
+    if (v > UINT_MAX) {
+        PyErr_Format(PyExc_OverflowError, "%s is greater than the maximum of %u", name, UINT_MAX);
+        return -1;
+    }
+    *value = (unsigned)v;
+    return 0;
+}
+
+/**
+ * Get a pointer to the contents of a bytes-like argument.
+ *
+ * A `bytearray` or `memoryview` could change while the GIL is released, so
+ * it is copied to `bytes`, which `*ref` holds until the caller releases it.
+ * Other read-only bytes-like objects are accepted through the "y#" format.
+ */
+static int
+parse_bytes(PyObject *obj, PyObject **ref, const unsigned char **data, Py_ssize_t *data_len)
+{
+    *ref = NULL;
+    if (PyByteArray_Check(obj) || PyMemoryView_Check(obj)) {
+        obj = *ref = PyBytes_FromObject(obj);
+        if (obj == NULL)
+            return -1;
+    }
+    if (PyBytes_Check(obj)) {
+        *data = (const unsigned char *)PyBytes_AsString(obj);
+        *data_len = PyBytes_Size(obj);
+        return 0;
+    }
+    return PyArg_Parse(obj, "y#", data, data_len) ? 0 : -1;
+}
+
+// STATIC TABLE
+
+/**
+ * The header names of the QPACK static table, see RFC 9204 Appendix A.
+ */
+static const char *static_table_names[] = {
+    ":authority", ":path", "age", "content-disposition", "content-length",
+    "cookie", "date", "etag", "if-modified-since", "if-none-match",
+    "last-modified", "link", "location", "referer", "set-cookie",
+    ":method", ":method", ":method", ":method", ":method", ":method",
+    ":method", ":scheme", ":scheme", ":status", ":status", ":status",
+    ":status", ":status", "accept", "accept", "accept-encoding",
+    "accept-ranges", "access-control-allow-headers",
+    "access-control-allow-headers", "access-control-allow-origin",
+    "cache-control", "cache-control", "cache-control", "cache-control",
+    "cache-control", "cache-control", "content-encoding", "content-encoding",
+    "content-type", "content-type", "content-type", "content-type",
+    "content-type", "content-type", "content-type", "content-type",
+    "content-type", "content-type", "content-type", "range",
+    "strict-transport-security", "strict-transport-security",
+    "strict-transport-security", "vary", "vary", "x-content-type-options",
+    "x-xss-protection", ":status", ":status", ":status", ":status",
+    ":status", ":status", ":status", ":status", ":status",
+    "accept-language", "access-control-allow-credentials",
+    "access-control-allow-credentials", "access-control-allow-headers",
+    "access-control-allow-methods", "access-control-allow-methods",
+    "access-control-allow-methods", "access-control-expose-headers",
+    "access-control-request-headers", "access-control-request-method",
+    "access-control-request-method", "alt-svc", "authorization",
+    "content-security-policy", "early-data", "expect-ct", "forwarded",
+    "if-range", "origin", "purpose", "server", "timing-allow-origin",
+    "upgrade-insecure-requests", "user-agent", "x-forwarded-for",
+    "x-frame-options", "x-frame-options",
+};
+
+/**
+ * The header values of the QPACK static table, in the same order.
+ */
+static const char *static_table_values[] = {
+    "", "/", "0", "", "0", "", "", "", "", "", "", "", "", "", "", "CONNECT",
+    "DELETE", "GET", "HEAD", "OPTIONS", "POST", "PUT", "http", "https", "103",
+    "200", "304", "404", "503", "*/*", "application/dns-message",
+    "gzip, deflate, br", "bytes", "cache-control", "content-type", "*",
+    "max-age=0", "max-age=2592000", "max-age=604800", "no-cache", "no-store",
+    "public, max-age=31536000", "br", "gzip", "application/dns-message",
+    "application/javascript", "application/json",
+    "application/x-www-form-urlencoded", "image/gif", "image/jpeg",
+    "image/png", "text/css", "text/html; charset=utf-8", "text/plain",
+    "text/plain;charset=utf-8", "bytes=0-", "max-age=31536000",
+    "max-age=31536000; includesubdomains",
+    "max-age=31536000; includesubdomains; preload", "accept-encoding",
+    "origin", "nosniff", "1; mode=block", "100", "204", "206", "302", "400",
+    "403", "421", "425", "500", "", "FALSE", "TRUE", "*", "get",
+    "get, post, options", "options", "content-length", "content-type", "get",
+    "post", "clear", "",
+    "script-src 'none'; object-src 'none'; base-uri 'none'", "1", "", "", "",
+    "", "prefetch", "", "*", "1", "", "", "deny", "sameorigin",
+};
+
+#define STATIC_TABLE_SIZE (sizeof(static_table_names) / sizeof(static_table_names[0]))
+
+// Interned `bytes` for the static table names, shared by all decoded headers.
+static PyObject *static_names[STATIC_TABLE_SIZE];
+
+static int
+static_names_init(void)
+{
+    for (size_t i = 0; i < STATIC_TABLE_SIZE; ++i) {
+        for (size_t j = 0; j < i; ++j) {
+            if (!strcmp(static_table_names[i], static_table_names[j])) {
+                static_names[i] = static_names[j];
+                break;
+            }
+        }
+        if (static_names[i]) {
+            Py_INCREF(static_names[i]);
+        } else {
+            static_names[i] = PyBytes_FromString(static_table_names[i]);
+            if (static_names[i] == NULL)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// VALIDATION
+
+// The header validation scans 16 bytes at a time where SSE2 or NEON is
+// available, and the remaining bytes one at a time.
+
+static int header_name_byte_invalid(unsigned char c)
+{
+    return c <= 0x20 || c >= 0x7f || (c >= 'A' && c <= 'Z') || c == ':';
+}
+
+/**
+ * Return whether a header name contains a byte which RFC 9114 forbids:
+ * controls, spaces, uppercase letters, colons and non-ASCII bytes.
+ */
+static int header_name_invalid(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+
+#if defined(VALIDATION_SSE2)
+    // The comparisons are signed, so bytes from 0x80 are below 0x21.
+    const __m128i space = _mm_set1_epi8(0x21), del = _mm_set1_epi8(0x7f);
+    const __m128i upper_lo = _mm_set1_epi8('A' - 1), upper_hi = _mm_set1_epi8('Z' + 1);
+    const __m128i colon = _mm_set1_epi8(':');
+    __m128i v, bad;
+
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        bad = _mm_or_si128(_mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)),
+                           _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, upper_lo), _mm_cmplt_epi8(v, upper_hi)),
+                                        _mm_cmpeq_epi8(v, colon)));
+        if (_mm_movemask_epi8(bad))
+            return 1;
+    }
+#elif defined(VALIDATION_NEON)
+    const uint8x16_t space = vdupq_n_u8(0x21), del = vdupq_n_u8(0x7f);
+    const uint8x16_t upper_lo = vdupq_n_u8('A'), upper_hi = vdupq_n_u8('Z');
+    const uint8x16_t colon = vdupq_n_u8(':');
+    uint8x16_t v, bad;
+
+    for (; i + 16 <= len; i += 16) {
+        v = vld1q_u8(p + i);
+        bad = vorrq_u8(vorrq_u8(vcltq_u8(v, space), vcgeq_u8(v, del)),
+                       vorrq_u8(vandq_u8(vcgeq_u8(v, upper_lo), vcleq_u8(v, upper_hi)), vceqq_u8(v, colon)));
+        if (vmaxvq_u8(bad))
+            return 1;
+    }
+#endif
+
+    for (; i < len; ++i) {
+        if (header_name_byte_invalid(p[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Return whether a header name or value contains CR, LF or NUL, which
+ * RFC 9114 forbids in both.
+ */
+static int header_has_forbidden_byte(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+
+#if defined(VALIDATION_SSE2)
+    const __m128i nul = _mm_setzero_si128(), lf = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+    __m128i v, bad;
+
+    for (; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        bad = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nul), _mm_cmpeq_epi8(v, lf)), _mm_cmpeq_epi8(v, cr));
+        if (_mm_movemask_epi8(bad))
+            return 1;
+    }
+#elif defined(VALIDATION_NEON)
+    const uint8x16_t nul = vdupq_n_u8(0), lf = vdupq_n_u8('\n'), cr = vdupq_n_u8('\r');
+    uint8x16_t v, bad;
+
+    for (; i + 16 <= len; i += 16) {
+        v = vld1q_u8(p + i);
+        bad = vorrq_u8(vorrq_u8(vceqq_u8(v, nul), vceqq_u8(v, lf)), vceqq_u8(v, cr));
+        if (vmaxvq_u8(bad))
+            return 1;
+    }
+#endif
+
+    for (; i < len; ++i) {
+        if (p[i] == '\0' || p[i] == '\n' || p[i] == '\r')
+            return 1;
+    }
+    return 0;
+}
+
+/**
+ * Check a header against the field rules of RFC 9114 Section 4.2, and that
+ * pseudo-headers come before regular headers. `regular` tells whether a
+ * regular header came before in the header list, and is updated.
+ *
+ * Returns a description of the problem, or NULL if the header is valid.
+ */
+static const char *header_check(const unsigned char *name, size_t name_len, const unsigned char *value,
+                                size_t value_len, int *regular)
+{
+    if (name_len && name[0] == ':') {
+        if (*regular)
+            return "pseudo-header after a regular header";
+        name++;
+        name_len--;
+    } else {
+        *regular = 1;
+    }
+    if (!name_len || header_name_invalid(name, name_len))
+        return "invalid name";
+    if (value_len && (value[0] == ' ' || value[0] == '\t' ||
+                      value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+        return "leading or trailing whitespace in value";
+    if (header_has_forbidden_byte(value, value_len))
+        return "forbidden character in value";
+    return NULL;
+}
+
+// HEADER BLOCK
+
+/**
+ * A decoded header, stored as offsets into the header block's buffer.
+ */
+struct decoded_header {
+    size_t name_off;
+    size_t name_len;
+    size_t value_off;
+    size_t value_len;
+    // The static table index of the header's name, or -1.
+    int static_idx;
+};
+
+static PyObject *decoded_header_name(const unsigned char *buf, const struct decoded_header *header)
+{
+    const char *name = (const char *)buf + header->name_off;
+
+    if (header->static_idx >= 0 && (size_t)header->static_idx < STATIC_TABLE_SIZE) {
+        PyObject *interned = static_names[header->static_idx];
+        if (PyBytes_Size(interned) == (Py_ssize_t)header->name_len &&
+            !memcmp(PyBytes_AsString(interned), name, header->name_len)) {
+            Py_INCREF(interned);
+            return interned;
+        }
+    }
+    return PyBytes_FromStringAndSize(name, header->name_len);
+}
+
+static PyObject *decoded_header_tuple(const unsigned char *buf, const struct decoded_header *header)
+{
+    PyObject *tuple, *name, *value;
+
+    name = decoded_header_name(buf, header);
+    if (name == NULL)
+        return NULL;
+    value = PyBytes_FromStringAndSize((const char *)buf + header->value_off, header->value_len);
+    if (value == NULL) {
+        Py_DECREF(name);
+        return NULL;
+    }
+    tuple = PyTuple_Pack(2, name, value);
+    Py_DECREF(name);
+    Py_DECREF(value);
+    return tuple;
+}
+
+struct header_block_index;
+
 struct header_block {
+    // Linkage in the index's queue of unblocked blocks.
     STAILQ_ENTRY(header_block) entries;
+    // Linkage in the index's hash chain.
+    struct header_block *next;
+    struct header_block_index *index;
 
     int blocked:1;
-    unsigned char *data;
-    size_t data_len;
+    // Whether the block was counted in the decoder's `blocked` statistic.
+    int was_blocked:1;
+    // The unread input, which points into the caller's memory until the
+    // block is blocked, and into `data_buf` afterwards.
     const unsigned char *data_ptr;
+    const unsigned char *data_end;
+    unsigned char *data_buf;
+    size_t data_buf_sz;
+    // The total size of the header block, and the number of bytes which
+    // have not been received yet when it is fed in chunks.
+    size_t header_size;
+    size_t missing;
     struct lsxpack_header xhdr;
-    // This buffer is owned by the header_block and is reused internally by xhdr.
-    char *header_buffer;
     uint64_t stream_id;
-    PyObject *headers;
+
+    // The decoded names and values are written back to back into this
+    // buffer, without any per-header allocation.
+    unsigned char *buf;
+    size_t buf_len;
+    size_t buf_sz;
+    struct decoded_header *headers;
+    size_t n_headers;
+    size_t headers_sz;
 };
 
-static struct header_block *header_block_new(size_t stream_id, const unsigned char *data, size_t data_len)
+/**
+ * Return the memory used by a header block and its buffers.
+ */
+static size_t header_block_mem_used(const struct header_block *hblock)
 {
-    struct header_block *hblock = malloc(sizeof(struct header_block));
-    memset(hblock, 0, sizeof(*hblock));
-    hblock->data = malloc(data_len);
-    hblock->data_len = data_len;
-    hblock->data_ptr = hblock->data;
-    memcpy(hblock->data, data, data_len);
-    hblock->stream_id = stream_id;
-    hblock->headers = PyList_New(0);
-    return hblock;
+    return sizeof(*hblock) + hblock->data_buf_sz + hblock->buf_sz + hblock->headers_sz * sizeof(*hblock->headers);
 }
 
 static void header_block_free(struct header_block *hblock)
 {
-    free(hblock->data);
-    hblock->data = 0;
-    hblock->data_ptr = 0;
-    free(hblock->header_buffer);
-    Py_DECREF(hblock->headers);
+    free(hblock->data_buf);
+    free(hblock->buf);
+    free(hblock->headers);
     free(hblock);
 }
 
+/**
+ * Keep a copy of the unread input, as the caller's memory is only valid
+ * for the duration of the call.
+ */
+static int header_block_keep_input(struct header_block *hblock)
+{
+    size_t len = hblock->data_end - hblock->data_ptr;
+
+    if (len) {
+        if (buffer_reserve(&hblock->data_buf, &hblock->data_buf_sz, len) < 0)
+            return -1;
+        memmove(hblock->data_buf, hblock->data_ptr, len);
+    }
+    hblock->data_ptr = hblock->data_buf;
+    hblock->data_end = hblock->data_buf + len;
+    return 0;
+}
+
+/**
+ * Append a chunk of input to the unread input kept in `data_buf`.
+ */
+static int header_block_append_input(struct header_block *hblock, const unsigned char *data, size_t data_len)
+{
+    size_t len = hblock->data_end - hblock->data_ptr;
+    size_t off = len ? hblock->data_ptr - hblock->data_buf : 0;
+
+    if (buffer_reserve(&hblock->data_buf, &hblock->data_buf_sz, len + data_len) < 0)
+        return -1;
+    memmove(hblock->data_buf, hblock->data_buf + off, len);
+    memcpy(hblock->data_buf + len, data, data_len);
+    hblock->data_ptr = hblock->data_buf;
+    hblock->data_end = hblock->data_buf + len + data_len;
+    return 0;
+}
+
+// The number of released header blocks a decoder keeps for reuse.
+#define HEADER_BLOCK_POOL_SIZE 16
+// The memory the released header blocks of a decoder may use, so that idle
+// decoders do not hold on to the buffers of their busiest moments.
+#define HEADER_BLOCK_POOL_MAX_BYTES 16384
+
+/**
+ * Released header blocks, which are reused along with their buffers so
+ * that decoding does not allocate memory in the steady state.
+ */
+struct header_block_pool {
+    struct header_block *free;
+    size_t count;
+    size_t bytes;
+};
+
+static struct header_block *header_block_new(struct header_block_pool *pool, uint64_t stream_id,
+                                             const unsigned char *data, size_t data_len)
+{
+    struct header_block *hblock = pool->free;
+
+    if (hblock) {
+        pool->free = hblock->next;
+        pool->count--;
+        pool->bytes -= header_block_mem_used(hblock);
+    } else {
+        hblock = calloc(1, sizeof(*hblock));
+        if (!hblock)
+            return NULL;
+    }
+    hblock->next = NULL;
+    hblock->blocked = 0;
+    hblock->was_blocked = 0;
+    hblock->data_ptr = data;
+    hblock->data_end = data + data_len;
+    hblock->header_size = data_len;
+    hblock->missing = 0;
+    hblock->stream_id = stream_id;
+    hblock->buf_len = 0;
+    hblock->n_headers = 0;
+    return hblock;
+}
+
+/**
+ * Return a header block to the pool, or free it if the pool is full.
+ */
+static void header_block_release(struct header_block_pool *pool, struct header_block *hblock)
+{
+    size_t size = header_block_mem_used(hblock);
+
+    if (pool->count == HEADER_BLOCK_POOL_SIZE || pool->bytes + size > HEADER_BLOCK_POOL_MAX_BYTES) {
+        header_block_free(hblock);
+        return;
+    }
+
+    hblock->data_ptr = hblock->data_end = NULL;
+    hblock->next = pool->free;
+    pool->free = hblock;
+    pool->count++;
+    pool->bytes += size;
+}
+
+static void header_block_pool_cleanup(struct header_block_pool *pool)
+{
+    struct header_block *hblock, *next;
+
+    for (hblock = pool->free; hblock; hblock = next) {
+        next = hblock->next;
+        header_block_free(hblock);
+    }
+    pool->free = NULL;
+    pool->count = 0;
+    pool->bytes = 0;
+}
+
+/**
+ * Header blocks which are pending decoding, indexed by stream ID.
+ */
+struct header_block_index {
+    struct header_block **buckets;
+    size_t n_buckets;
+    size_t count;
+    // Blocks which were unblocked since the queue was last drained.
+    STAILQ_HEAD(, header_block) unblocked;
+};
+
+static void header_block_index_init(struct header_block_index *index)
+{
+    memset(index, 0, sizeof(*index));
+    STAILQ_INIT(&index->unblocked);
+}
+
+static size_t header_block_index_bucket(const struct header_block_index *index, uint64_t stream_id)
+{
+    // Stream IDs of a given type are multiples of 4, so mix the bits
+    // using Fibonacci hashing.
+    return (size_t)((stream_id * 0x9E3779B97F4A7C15ULL) >> 32) & (index->n_buckets - 1);
+}
+
+static struct header_block *header_block_index_find(const struct header_block_index *index, uint64_t stream_id)
+{
+    struct header_block *hblock;
+
+    if (!index->n_buckets)
+        return NULL;
+    for (hblock = index->buckets[header_block_index_bucket(index, stream_id)]; hblock; hblock = hblock->next) {
+        if (hblock->stream_id == stream_id)
+            return hblock;
+    }
+    return NULL;
+}
+
+static int header_block_index_insert(struct header_block_index *index, struct header_block *hblock)
+{
+    struct header_block **buckets, **old_buckets = index->buckets, *next;
+    size_t bucket, n_buckets, old_n_buckets = index->n_buckets;
+
+    // Keep the load factor at or below one.
+    if (index->count >= index->n_buckets) {
+        n_buckets = index->n_buckets ? 2 * index->n_buckets : 16;
+        buckets = calloc(n_buckets, sizeof(*buckets));
+        if (!buckets)
+            return -1;
+        index->buckets = buckets;
+        index->n_buckets = n_buckets;
+        for (size_t i = 0; i < old_n_buckets; ++i) {
+            for (struct header_block *b = old_buckets[i]; b; b = next) {
+                next = b->next;
+                bucket = header_block_index_bucket(index, b->stream_id);
+                b->next = buckets[bucket];
+                buckets[bucket] = b;
+            }
+        }
+        free(old_buckets);
+    }
+
+    bucket = header_block_index_bucket(index, hblock->stream_id);
+    hblock->next = index->buckets[bucket];
+    hblock->index = index;
+    index->buckets[bucket] = hblock;
+    index->count++;
+    return 0;
+}
+
+static void header_block_index_remove(struct header_block_index *index, struct header_block *hblock)
+{
+    struct header_block **prev = &index->buckets[header_block_index_bucket(index, hblock->stream_id)];
+
+    while (*prev != hblock)
+        prev = &(*prev)->next;
+    *prev = hblock->next;
+    hblock->next = NULL;
+    hblock->index = NULL;
+    index->count--;
+
+    // Only blocked streams are indexed, so release the buckets once there
+    // are none left.
+    if (!index->count) {
+        free(index->buckets);
+        index->buckets = NULL;
+        index->n_buckets = 0;
+    }
+}
+
+/**
+ * Free all the header blocks in the index.
+ */
+static void header_block_index_cleanup(struct header_block_index *index)
+{
+    struct header_block *hblock, *next;
+
+    for (size_t i = 0; i < index->n_buckets; ++i) {
+        for (hblock = index->buckets[i]; hblock; hblock = next) {
+            next = hblock->next;
+            header_block_free(hblock);
+        }
+    }
+    free(index->buckets);
+    header_block_index_init(index);
+}
+
 static void header_block_unblocked(void *opaque) {
     struct header_block *hblock = opaque;
     hblock->blocked = 0;
+    STAILQ_INSERT_TAIL(&hblock->index->unblocked, hblock, entries);
 }
 
 /**
- * Prepare to decode a header by allocating the requested memory.
+ * Prepare to decode a header by reserving the requested memory at the end
+ * of the header block's buffer.
  */
 static struct lsxpack_header *header_block_prepare_decode(void *opaque, struct lsxpack_header *xhdr, size_t space) {
     struct header_block *hblock = opaque;
     char *buf;
 
-    // The behaviour of realloc(ptr, 0) is implementation specific,
-    // so if asked for a zero size we explicitly free the memory.
-    if (space) {
-        buf = realloc(hblock->header_buffer, space);
-        if (!buf) return NULL;
-    } else {
-        free(hblock->header_buffer);
-        buf = 0;
-    }
-    hblock->header_buffer = buf;
+    if (buffer_reserve(&hblock->buf, &hblock->buf_sz, hblock->buf_len + space) < 0)
+        return NULL;
+    buf = (char *)hblock->buf + hblock->buf_len;
 
     if (xhdr) {
         assert(&hblock->xhdr == xhdr);
@@ -95,20 +812,29 @@ static struct lsxpack_header *header_block_prepare_decode(void *opaque, struct l
 }
 
 /**
- * Process a decoded header by appending it to the list of headers.
+ * Process a decoded header by recording its position in the buffer.
  */
 static int header_block_process_header(void *opaque, struct lsxpack_header *xhdr) {
     struct header_block *hblock = opaque;
-    PyObject *tuple, *name, *value;
-
-    name = PyBytes_FromStringAndSize(lsxpack_header_get_name(xhdr), xhdr->name_len);
-    value = PyBytes_FromStringAndSize(lsxpack_header_get_value(xhdr), xhdr->val_len);
-    tuple = PyTuple_Pack(2, name, value);
-    Py_DECREF(name);
-    Py_DECREF(value);
+    struct decoded_header *header;
+    size_t base = (unsigned char *)xhdr->buf - hblock->buf;
+
+    if (hblock->n_headers == hblock->headers_sz) {
+        size_t headers_sz = hblock->headers_sz ? 2 * hblock->headers_sz : 16;
+        header = realloc(hblock->headers, headers_sz * sizeof(*header));
+        if (!header)
+            return -1;
+        hblock->headers = header;
+        hblock->headers_sz = headers_sz;
+    }
 
-    PyList_Append(hblock->headers, tuple);
-    Py_DECREF(tuple);
+    header = &hblock->headers[hblock->n_headers++];
+    header->name_off = base + xhdr->name_offset;
+    header->name_len = xhdr->name_len;
+    header->value_off = base + xhdr->val_offset;
+    header->value_len = xhdr->val_len;
+    header->static_idx = (xhdr->flags & LSXPACK_QPACK_IDX) ? xhdr->qpack_index : -1;
+    hblock->buf_len = header->value_off + header->value_len;
 
     return 0;
 }
@@ -119,42 +845,357 @@ static const struct lsqpack_dec_hset_if header_block_if = {
     .dhi_process_header = header_block_process_header,
 };
 
-// DECODER
+// HEADER LIST
 
 typedef struct {
     PyObject_HEAD
+    unsigned char *buf;
+    struct decoded_header *headers;
+    Py_ssize_t n_headers;
+} HeaderListObject;
+
+static void
+HeaderList_dealloc(HeaderListObject *self)
+{
+    free(self->buf);
+    free(self->headers);
+
+    PyTypeObject *tp = Py_TYPE(self);
+    freefunc free = PyType_GetSlot(tp, Py_tp_free);
+    free(self);
+    Py_DECREF(tp);
+}
+
+static Py_ssize_t
+HeaderList_length(HeaderListObject *self)
+{
+    return self->n_headers;
+}
+
+static PyObject*
+HeaderList_item(HeaderListObject *self, Py_ssize_t i)
+{
+    if (i < 0 || i >= self->n_headers) {
+        PyErr_SetString(PyExc_IndexError, "header index out of range");
+        return NULL;
+    }
+    return decoded_header_tuple(self->buf, &self->headers[i]);
+}
+
+static PyObject*
+HeaderList_subscript(HeaderListObject *self, PyObject *key)
+{
+    Py_ssize_t start, stop, step, count, i;
+    PyObject *list, *tuple;
+
+    if (!PySlice_Check(key)) {
+        i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (i == -1 && PyErr_Occurred())
+            return NULL;
+        if (i < 0)
+            i += self->n_headers;
+        return HeaderList_item(self, i);
+    }
+
+    if (PySlice_Unpack(key, &start, &stop, &step) < 0)
+        return NULL;
+    count = PySlice_AdjustIndices(self->n_headers, &start, &stop, step);
+    list = PyList_New(count);
+    if (list == NULL)
+        return NULL;
+    for (i = 0; i < count; ++i) {
+        tuple = decoded_header_tuple(self->buf, &self->headers[start + i * step]);
+        if (tuple == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SetItem(list, i, tuple);
+    }
+    return list;
+}
+
+static PyObject*
+HeaderList_richcompare(PyObject *self, PyObject *other, int op)
+{
+    PyObject *list, *result;
+
+    if (!PyList_Check(other) && !PyObject_TypeCheck(other, (PyTypeObject*)HeaderListType))
+        Py_RETURN_NOTIMPLEMENTED;
+
+    list = PySequence_List(self);
+    if (list == NULL)
+        return NULL;
+    result = PyObject_RichCompare(list, other, op);
+    Py_DECREF(list);
+    return result;
+}
+
+static PyObject*
+HeaderList_repr(PyObject *self)
+{
+    PyObject *list, *result;
+
+    list = PySequence_List(self);
+    if (list == NULL)
+        return NULL;
+    result = PyUnicode_FromFormat("HeaderList(%R)", list);
+    Py_DECREF(list);
+    return result;
+}
+
+PyDoc_STRVAR(HeaderList__doc__,
+    "A read-only sequence of decoded headers.\n\n"
+    "The names and values are kept in a single buffer, and the "
+    "`(name, value)` tuples are only created when accessed.\n");
+
+static PyType_Slot HeaderListType_slots[] = {
+    {Py_tp_dealloc, HeaderList_dealloc},
+    {Py_tp_doc, (char *)HeaderList__doc__},
+    {Py_tp_repr, HeaderList_repr},
+    {Py_tp_richcompare, HeaderList_richcompare},
+    {Py_mp_length, HeaderList_length},
+    {Py_mp_subscript, HeaderList_subscript},
+    {Py_sq_item, HeaderList_item},
+    {Py_sq_length, HeaderList_length},
+    {0, 0},
+};
+
+static PyType_Spec HeaderListType_spec = {
+    MODULE_NAME ".HeaderList",
+    sizeof(HeaderListObject),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    HeaderListType_slots
+};
+
+/**
+ * The formats in which a decoder returns its headers.
+ */
+enum headers_format {
+    HEADERS_LIST,
+    HEADERS_LAZY,
+    HEADERS_HTTP1,
+};
+
+/**
+ * Return the headers of a header block formatted for HTTP/1.x.
+ *
+ * The result is a `(pseudo_headers, fields)` tuple, where `fields` holds
+ * the regular headers as `name: value\r\n` lines in a single bytes object.
+ * Headers containing CR, LF or NUL raise HeaderValidationError, as they
+ * could not be forwarded safely.
+ */
+static PyObject *header_block_http1(struct header_block *hblock)
+{
+    PyObject *pseudo, *fields, *tuple, *result;
+    const struct decoded_header *header;
+    const unsigned char *name, *value;
+    size_t fields_len = 0;
+    char *pos;
+
+    pseudo = PyList_New(0);
+    if (pseudo == NULL)
+        return NULL;
+    for (size_t i = 0; i < hblock->n_headers; ++i) {
+        header = &hblock->headers[i];
+        name = hblock->buf + header->name_off;
+        value = hblock->buf + header->value_off;
+        if (header_has_forbidden_byte(name, header->name_len) ||
+            header_has_forbidden_byte(value, header->value_len)) {
+            PyErr_Format(HeaderValidationError, "header %zu cannot be formatted for HTTP/1.x", i);
+            Py_DECREF(pseudo);
+            return NULL;
+        }
+        if (header->name_len && name[0] == ':') {
+            tuple = decoded_header_tuple(hblock->buf, header);
+            if (tuple == NULL || PyList_Append(pseudo, tuple) < 0) {
+                Py_XDECREF(tuple);
+                Py_DECREF(pseudo);
+                return NULL;
+            }
+            Py_DECREF(tuple);
+        } else {
+            fields_len += header->name_len + header->value_len + 4;
+        }
+    }
+
+    fields = PyBytes_FromStringAndSize(NULL, fields_len);
+    if (fields == NULL) {
+        Py_DECREF(pseudo);
+        return NULL;
+    }
+    pos = PyBytes_AsString(fields);
+    for (size_t i = 0; i < hblock->n_headers; ++i) {
+        header = &hblock->headers[i];
+        name = hblock->buf + header->name_off;
+        if (header->name_len && name[0] == ':')
+            continue;
+        memcpy(pos, name, header->name_len);
+        pos += header->name_len;
+        *pos++ = ':';
+        *pos++ = ' ';
+        memcpy(pos, hblock->buf + header->value_off, header->value_len);
+        pos += header->value_len;
+        *pos++ = '\r';
+        *pos++ = '\n';
+    }
+
+    result = PyTuple_Pack(2, pseudo, fields);
+    Py_DECREF(pseudo);
+    Py_DECREF(fields);
+    return result;
+}
+
+/**
+ * Return the decoded headers of a header block.
+ *
+ * With HEADERS_LAZY, the header block's buffers are handed over to a
+ * HeaderList, with HEADERS_HTTP1 they are formatted by header_block_http1(),
+ * otherwise a list of `(name, value)` tuples is built.
+ */
+static PyObject *header_block_headers(struct header_block *hblock, enum headers_format format)
+{
+    PyObject *list, *tuple;
+
+    if (format == HEADERS_HTTP1)
+        return header_block_http1(hblock);
+
+    if (format == HEADERS_LAZY) {
+        HeaderListObject *hlist = PyObject_New(HeaderListObject, (PyTypeObject*)HeaderListType);
+        if (hlist == NULL)
+            return NULL;
+        hlist->buf = hblock->buf;
+        hlist->headers = hblock->headers;
+        hlist->n_headers = hblock->n_headers;
+        hblock->buf = NULL;
+        hblock->buf_len = hblock->buf_sz = 0;
+        hblock->headers = NULL;
+        hblock->n_headers = hblock->headers_sz = 0;
+        return (PyObject*)hlist;
+    }
+
+    list = PyList_New(hblock->n_headers);
+    if (list == NULL)
+        return NULL;
+    for (size_t i = 0; i < hblock->n_headers; ++i) {
+        tuple = decoded_header_tuple(hblock->buf, &hblock->headers[i]);
+        if (tuple == NULL) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SetItem(list, i, tuple);
+    }
+    return list;
+}
+
+// DECODER
+
+typedef struct {
+    PyObject_HEAD
+    PyThread_type_lock lock;
     struct lsqpack_dec dec;
+    // Without a dynamic table, there are no references to cancel.
+    unsigned max_table_capacity;
     unsigned char dec_buf[DEC_BUF_SZ];
-    STAILQ_HEAD(, header_block) pending_blocks;
+    struct header_block_index pending_blocks;
+    struct header_block_pool free_blocks;
+    enum headers_format headers_format;
+    int validate_headers;
+    // The callable which receives the decoded header blocks, or NULL.
+    PyObject *sink;
+    // The decoder stream instructions held until flush_decoder_stream().
+    int coalesce;
+    unsigned char *stream_buf;
+    size_t stream_buf_len;
+    size_t stream_buf_sz;
+    struct {
+        unsigned long long blocked;
+        unsigned long long decoder_stream_bytes;
+        unsigned long long encoder_stream_bytes;
+        unsigned long long header_block_bytes;
+        unsigned long long header_bytes;
+        unsigned long long headers;
+    } stats;
 } DecoderObject;
 
 static int
 Decoder_init(DecoderObject *self, PyObject *args, PyObject *kwargs)
 {
-    char *kwlist[] = {"max_table_capacity", "blocked_streams", NULL};
+    char *kwlist[] = {"max_table_capacity", "blocked_streams", "lazy_headers", "sink",
+                      "coalesce_decoder_stream", "http1_headers", "validate_headers", NULL};
     unsigned max_table_capacity, blocked_streams;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "II", kwlist, &max_table_capacity, &blocked_streams))
+    int lazy_headers = 0, coalesce = 0, http1_headers = 0, validate_headers = 0;
+    PyObject *sink = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "II|$pOppp", kwlist, &max_table_capacity, &blocked_streams,
+                                     &lazy_headers, &sink, &coalesce, &http1_headers, &validate_headers))
+        return -1;
+
+    if (lazy_headers && http1_headers) {
+        PyErr_SetString(PyExc_ValueError, "lazy_headers and http1_headers cannot be combined");
+        return -1;
+    }
+
+    if (sink != Py_None && !PyCallable_Check(sink)) {
+        PyErr_SetString(PyExc_TypeError, "sink must be callable");
+        return -1;
+    }
+
+    // ls-qpack state cannot be initialized twice without leaking, and the
+    // lock is only allocated once initialization can no longer fail.
+    if (self->lock) {
+        PyErr_SetString(PyExc_RuntimeError, "the decoder is already initialized");
+        return -1;
+    }
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock) {
+        PyErr_SetString(PyExc_MemoryError, "unable to allocate lock");
         return -1;
+    }
+
+    self->headers_format = http1_headers ? HEADERS_HTTP1 : lazy_headers ? HEADERS_LAZY : HEADERS_LIST;
+    self->coalesce = coalesce;
+    self->validate_headers = validate_headers;
+    self->stream_buf_len = 0;
+    self->max_table_capacity = max_table_capacity;
+    self->sink = sink == Py_None ? NULL : sink;
+    Py_XINCREF(self->sink);
 
     lsqpack_dec_init(&self->dec, NULL, max_table_capacity, blocked_streams, &header_block_if, 0);
 
-    STAILQ_INIT(&self->pending_blocks);
+    header_block_index_init(&self->pending_blocks);
+
+    return 0;
+}
+
+static int
+Decoder_traverse(DecoderObject *self, visitproc visit, void *arg)
+{
+    Py_VISIT(self->sink);
+    Py_VISIT(Py_TYPE(self));
+    return 0;
+}
 
+static int
+Decoder_clear(DecoderObject *self)
+{
+    Py_CLEAR(self->sink);
     return 0;
 }
 
 static void
 Decoder_dealloc(DecoderObject *self)
 {
-    struct header_block *hblock;
+    PyObject_GC_UnTrack(self);
+    Decoder_clear(self);
 
     lsqpack_dec_cleanup(&self->dec);
 
-    while (!STAILQ_EMPTY(&self->pending_blocks)) {
-        hblock = STAILQ_FIRST(&self->pending_blocks);
-        STAILQ_REMOVE_HEAD(&self->pending_blocks, entries);
-        header_block_free(hblock);
-    }
+    header_block_index_cleanup(&self->pending_blocks);
+    header_block_pool_cleanup(&self->free_blocks);
+    free(self->stream_buf);
+
+    if (self->lock)
+        PyThread_free_lock(self->lock);
 
     PyTypeObject *tp = Py_TYPE(self);
     freefunc free = PyType_GetSlot(tp, Py_tp_free);
@@ -162,357 +1203,2135 @@ Decoder_dealloc(DecoderObject *self)
     Py_DECREF(tp);
 }
 
-PyDoc_STRVAR(Decoder_feed_encoder__doc__,
-    "feed_encoder(data: bytes) -> List[int]\n\n"
-    "Feed data from the encoder stream.\n\n"
-    "If processing the data unblocked any streams, their IDs are returned, "
-    "and :meth:`resume_header()` must be called for each stream ID.\n\n"
-    "If the data cannot be processed, :class:`EncoderStreamError` is raised.\n\n"
-    ":param data: the encoder stream data\n");
-
+/**
+ * Update the statistics for a decoded header block.
+ */
+static void
+decoder_count_headers(DecoderObject *self, const struct header_block *hblock, size_t dec_len)
+{
+    self->stats.decoder_stream_bytes += dec_len;
+    self->stats.headers += hblock->n_headers;
+    for (size_t i = 0; i < hblock->n_headers; ++i)
+        self->stats.header_bytes += hblock->headers[i].name_len + hblock->headers[i].value_len;
+}
+
+/**
+ * Pass the result of decoding a header block to the sink, if there is one.
+ *
+ * This must be called without holding the decoder's lock, so that the sink
+ * can call the decoder. A blocked stream is not an error in sink mode, as the
+ * header block is passed to the sink once it is unblocked.
+ */
+static PyObject*
+decoder_deliver(DecoderObject *self, uint64_t stream_id, PyObject *result)
+{
+    PyObject *ret;
+
+    if (!self->sink)
+        return result;
+
+    if (result == NULL) {
+        if (!PyErr_ExceptionMatches(StreamBlocked))
+            return NULL;
+        PyErr_Clear();
+        Py_RETURN_NONE;
+    } else if (result == Py_None) {
+        return result;
+    }
+
+    ret = PyObject_CallFunction(self->sink, "KOO", (unsigned long long)stream_id,
+                                PyTuple_GetItem(result, 0), PyTuple_GetItem(result, 1));
+    Py_DECREF(result);
+    if (ret == NULL)
+        return NULL;
+    Py_DECREF(ret);
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+decoder_resume_header(DecoderObject *self, uint64_t stream_id);
+
+/**
+ * Take the current exception, with its traceback attached.
+ */
+static PyObject*
+fetch_exception(void)
+{
+    PyObject *exc_type, *exc_value, *exc_tb;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+    if (exc_tb)
+        PyException_SetTraceback(exc_value, exc_tb);
+    Py_XDECREF(exc_type);
+    Py_XDECREF(exc_tb);
+    return exc_value;
+}
+
+/**
+ * Decode the header blocks of the streams in `list`, which were unblocked
+ * by encoder stream data, for passing them to the sink.
+ *
+ * Each item of the returned list is a `(stream_id, result)` tuple, where
+ * `result` is either the `(control, headers)` tuple or the exception raised
+ * while decoding the block.
+ */
+static PyObject*
+decoder_resume_unblocked(DecoderObject *self, PyObject *list)
+{
+    PyObject *results, *result, *item;
+    Py_ssize_t i;
+
+    results = PyList_New(0);
+    for (i = 0; results && i < PyList_Size(list); i++) {
+        item = PyList_GetItem(list, i);
+        result = decoder_resume_header(self, PyLong_AsUnsignedLongLong(item));
+        if (result == NULL) {
+            if (PyErr_ExceptionMatches(StreamBlocked)) {
+                PyErr_Clear();
+                continue;
+            }
+            result = fetch_exception();
+        }
+        item = PyTuple_Pack(2, item, result);
+        Py_DECREF(result);
+        if (item == NULL || PyList_Append(results, item) < 0)
+            Py_CLEAR(results);
+        Py_XDECREF(item);
+    }
+
+    Py_DECREF(list);
+    return results;
+}
+
+/**
+ * Pass the header blocks decoded by decoder_resume_unblocked() to the sink.
+ *
+ * All the blocks are passed to the sink even if one of them failed to decode
+ * or the sink raised, after which the first exception is raised.
+ */
+static PyObject*
+decoder_deliver_unblocked(DecoderObject *self, PyObject *results)
+{
+    PyObject *item, *result, *ret, *first = NULL;
+    Py_ssize_t i;
+
+    for (i = 0; i < PyList_Size(results); i++) {
+        item = PyList_GetItem(results, i);
+        result = PyTuple_GetItem(item, 1);
+        if (PyExceptionInstance_Check(result)) {
+            if (first == NULL) {
+                first = result;
+                Py_INCREF(first);
+            }
+            continue;
+        }
+
+        ret = PyObject_CallFunctionObjArgs(self->sink, PyTuple_GetItem(item, 0),
+                                           PyTuple_GetItem(result, 0), PyTuple_GetItem(result, 1), NULL);
+        if (ret == NULL) {
+            if (first == NULL)
+                first = fetch_exception();
+            else
+                PyErr_Clear();
+        }
+        Py_XDECREF(ret);
+    }
+    Py_DECREF(results);
+
+    if (first) {
+        Py_INCREF(Py_TYPE(first));
+        PyErr_Restore((PyObject *)Py_TYPE(first), first, PyException_GetTraceback(first));
+        return NULL;
+    }
+    return PyList_New(0);
+}
+
+PyDoc_STRVAR(Decoder_feed_encoder__doc__,
+    "feed_encoder(data: bytes) -> List[int]\n\n"
+    "Feed data from the encoder stream.\n\n"
+    "If processing the data unblocked any streams, their IDs are returned, "
+    "and :meth:`resume_header()` must be called for each stream ID. Each "
+    "stream ID is only returned by the call which unblocked it. Streams "
+    "whose header block is still being fed with :meth:`feed_header_chunk()` "
+    "are not returned, as decoding continues with their next chunk.\n\n"
+    "If the decoder has a sink, the unblocked header blocks are decoded and "
+    "passed to it, and an empty list is returned.\n\n"
+    "If the data cannot be processed, :class:`EncoderStreamError` is raised.\n\n"
+    ":param data: the encoder stream data\n");
+
+static PyObject*
+Decoder_feed_encoder(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"data", NULL};
+    PyObject *values[1];
+    const unsigned char *data;
+    Py_ssize_t data_len;
+    PyObject *list, *ref, *value;
+    PyThreadState *gil;
+    struct header_block *hblock;
+    int ret;
+
+    if (parse_args("feed_encoder", kwlist, 1, 1, args, nargs, kwnames, values) < 0 ||
+        parse_bytes(values[0], &ref, &data, &data_len) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+
+    self->stats.encoder_stream_bytes += data_len;
+    gil = gil_release(data_len);
+    ret = lsqpack_dec_enc_in(&self->dec, data, data_len);
+    gil_restore(gil);
+    Py_XDECREF(ref);
+    if (ret < 0) {
+        PyErr_SetString(EncoderStreamError, "lsqpack_dec_enc_in failed");
+        list = NULL;
+    } else {
+        list = PyList_New(0);
+    }
+
+    // Drain the blocks which were unblocked by this data. Blocks which are
+    // still being received are resumed by their next chunk instead.
+    while (!STAILQ_EMPTY(&self->pending_blocks.unblocked)) {
+        hblock = STAILQ_FIRST(&self->pending_blocks.unblocked);
+        STAILQ_REMOVE_HEAD(&self->pending_blocks.unblocked, entries);
+        if (list && !hblock->missing) {
+            value = PyLong_FromUnsignedLongLong(hblock->stream_id);
+            if (value == NULL || PyList_Append(list, value) < 0)
+                Py_CLEAR(list);
+            Py_XDECREF(value);
+        }
+    }
+
+    // In sink mode, decode the unblocked blocks while holding the lock, but
+    // only call the sink once the lock is released.
+    if (list && self->sink)
+        list = decoder_resume_unblocked(self, list);
+
+    RELEASE_LOCK(self);
+
+    if (list && self->sink)
+        return decoder_deliver_unblocked(self, list);
+    return list;
+}
+
+/**
+ * Mark a header block as blocked, counting it the first time it blocks.
+ */
+static void
+decoder_block(DecoderObject *self, struct header_block *hblock)
+{
+    if (!hblock->was_blocked)
+        self->stats.blocked++;
+    hblock->blocked = 1;
+    hblock->was_blocked = 1;
+}
+
+/**
+ * Return the decoder stream instructions written to `dec_buf`, or hold
+ * them back until flush_decoder_stream() if the decoder coalesces them.
+ */
+static PyObject*
+decoder_control(DecoderObject *self, size_t dec_len)
+{
+    if (self->coalesce && dec_len) {
+        if (buffer_reserve(&self->stream_buf, &self->stream_buf_sz, self->stream_buf_len + dec_len) < 0)
+            return PyErr_NoMemory();
+        memcpy(self->stream_buf + self->stream_buf_len, self->dec_buf, dec_len);
+        self->stream_buf_len += dec_len;
+        dec_len = 0;
+    }
+    return PyBytes_FromStringAndSize((const char*)self->dec_buf, dec_len);
+}
+
+/**
+ * Check the decoded headers if the decoder validates them.
+ */
+static int
+decoder_validate_headers(DecoderObject *self, const struct header_block *hblock)
+{
+    const struct decoded_header *header;
+    const char *error;
+    int regular = 0;
+
+    if (!self->validate_headers)
+        return 0;
+    for (size_t i = 0; i < hblock->n_headers; ++i) {
+        header = &hblock->headers[i];
+        error = header_check(hblock->buf + header->name_off, header->name_len, hblock->buf + header->value_off,
+                             header->value_len, &regular);
+        if (error) {
+            PyErr_Format(HeaderValidationError, "header %zu of stream %llu: %s", i,
+                         (unsigned long long)hblock->stream_id, error);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Attach the decoder stream data for a rejected header block to the
+ * HeaderValidationError being raised, as `control`. ls-qpack has already
+ * acknowledged the block, so this data must still be sent to the encoder.
+ */
+static void
+decoder_error_set_control(PyObject *control)
+{
+    PyObject *exc_type, *exc_value, *exc_tb;
+
+    if (!PyErr_ExceptionMatches(HeaderValidationError))
+        return;
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+    if (PyObject_SetAttrString(exc_value, "control", control) < 0) {
+        Py_XDECREF(exc_type);
+        Py_XDECREF(exc_value);
+        Py_XDECREF(exc_tb);
+        return;
+    }
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/**
+ * Build the result for a fully decoded header block, and free the block.
+ */
+static PyObject*
+decoder_header_done(DecoderObject *self, struct header_block *hblock, size_t dec_len)
+{
+    PyObject *control, *headers, *tuple;
+
+    decoder_count_headers(self, hblock, dec_len);
+    control = decoder_control(self, dec_len);
+    if (control == NULL) {
+        header_block_release(&self->free_blocks, hblock);
+        return NULL;
+    }
+    if (decoder_validate_headers(self, hblock) < 0)
+        headers = NULL;
+    else
+        headers = header_block_headers(hblock, self->headers_format);
+    header_block_release(&self->free_blocks, hblock);
+    if (headers == NULL) {
+        decoder_error_set_control(control);
+        Py_DECREF(control);
+        return NULL;
+    }
+    tuple = PyTuple_Pack(2, control, headers);
+    Py_DECREF(control);
+    Py_DECREF(headers);
+
+    return tuple;
+}
+
+static PyObject*
+decoder_feed_header(DecoderObject *self, uint64_t stream_id, const unsigned char *data, size_t data_len)
+{
+    size_t dec_len = DEC_BUF_SZ;
+    enum lsqpack_read_header_status status;
+    struct header_block *hblock;
+    PyThreadState *gil;
+
+    // check there is no header block for the stream
+    if (header_block_index_find(&self->pending_blocks, stream_id)) {
+        PyErr_Format(PyExc_ValueError, "a header block for stream %d already exists", stream_id);
+        return NULL;
+    }
+    // The input is decoded in place, and only copied if the block is blocked.
+    hblock = header_block_new(&self->free_blocks, stream_id, data, data_len);
+    if (!hblock)
+        return PyErr_NoMemory();
+    self->stats.header_block_bytes += data_len;
+
+    gil = gil_release(data_len);
+    status = lsqpack_dec_header_in(
+        &self->dec,
+        hblock,
+        stream_id,
+        data_len,
+        &hblock->data_ptr,
+        data_len,
+        self->dec_buf,
+        &dec_len
+    );
+    gil_restore(gil);
+
+    if (status == LQRHS_BLOCKED || status == LQRHS_NEED) {
+        decoder_block(self, hblock);
+        if (header_block_keep_input(hblock) < 0 ||
+            header_block_index_insert(&self->pending_blocks, hblock) < 0) {
+            lsqpack_dec_unref_stream(&self->dec, hblock);
+            header_block_release(&self->free_blocks, hblock);
+            return PyErr_NoMemory();
+        }
+        PyErr_Format(StreamBlocked, "stream %d is blocked", stream_id);
+        return NULL;
+    } else if (status != LQRHS_DONE) {
+        PyErr_Format(DecompressionFailed, "lsqpack_dec_header_in for stream %d failed", stream_id);
+        header_block_release(&self->free_blocks, hblock);
+        return NULL;
+    }
+
+    return decoder_header_done(self, hblock, dec_len);
+}
+
+PyDoc_STRVAR(Decoder_feed_header__doc__,
+    "feed_header(stream_id: int, data: bytes) -> Tuple[bytes, List[Tuple[bytes, bytes]]]\n\n"
+    "Decode a header block and return control data and headers.\n\n"
+    "If the stream is blocked, :class:`StreamBlocked` is raised.\n\n"
+    "If the decoder has a sink, the control data and headers are passed to "
+    "it instead and `None` is returned, including when the stream is "
+    "blocked.\n\n"
+    "If the data cannot be processed, :class:`DecompressionFailed` is raised.\n\n"
+    ":param stream_id: the ID of the stream\n"
+    ":param data: the header block data\n");
+
+static PyObject*
+Decoder_feed_header(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"stream_id", "data", NULL};
+    PyObject *values[2];
+    uint64_t stream_id;
+    const unsigned char *data;
+    Py_ssize_t data_len;
+    PyObject *ref, *tuple;
+
+    if (parse_args("feed_header", kwlist, 2, 2, args, nargs, kwnames, values) < 0 ||
+        parse_uint64(values[0], "stream_id", &stream_id) < 0 ||
+        parse_bytes(values[1], &ref, &data, &data_len) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+    tuple = decoder_feed_header(self, stream_id, data, data_len);
+    RELEASE_LOCK(self);
+    Py_XDECREF(ref);
+
+    return decoder_deliver(self, stream_id, tuple);
+}
+
+static PyObject*
+decoder_feed_header_chunk(DecoderObject *self, uint64_t stream_id, const unsigned char *data, size_t data_len,
+                          size_t header_size)
+{
+    size_t dec_len = DEC_BUF_SZ;
+    enum lsqpack_read_header_status status;
+    struct header_block *hblock;
+    PyThreadState *gil;
+
+    hblock = header_block_index_find(&self->pending_blocks, stream_id);
+    if (hblock && (!hblock->missing || hblock->header_size != header_size)) {
+        PyErr_Format(PyExc_ValueError, "a header block for stream %d already exists", stream_id);
+        return NULL;
+    }
+    if (data_len > (hblock ? hblock->missing : header_size)) {
+        PyErr_SetString(PyExc_ValueError, "the data exceeds the size of the header block");
+        return NULL;
+    }
+    self->stats.header_block_bytes += data_len;
+
+    if (!hblock) {
+        hblock = header_block_new(&self->free_blocks, stream_id, data, data_len);
+        if (!hblock)
+            return PyErr_NoMemory();
+        hblock->header_size = header_size;
+        hblock->missing = header_size - data_len;
+
+        gil = gil_release(data_len);
+        status = lsqpack_dec_header_in(
+            &self->dec,
+            hblock,
+            stream_id,
+            header_size,
+            &hblock->data_ptr,
+            data_len,
+            self->dec_buf,
+            &dec_len
+        );
+        gil_restore(gil);
+    } else {
+        hblock->missing -= data_len;
+
+        // Decode the chunk in place, unless some earlier input is unread.
+        if (hblock->data_ptr == hblock->data_end) {
+            hblock->data_ptr = data;
+            hblock->data_end = data + data_len;
+        } else if (header_block_append_input(hblock, data, data_len) < 0) {
+            goto nomem;
+        }
+
+        if (hblock->blocked) {
+            status = LQRHS_BLOCKED;
+        } else {
+            gil = gil_release(hblock->data_end - hblock->data_ptr);
+            status = lsqpack_dec_header_read(
+                &self->dec,
+                hblock,
+                &hblock->data_ptr,
+                hblock->data_end - hblock->data_ptr,
+                self->dec_buf,
+                &dec_len
+            );
+            gil_restore(gil);
+        }
+    }
+
+    if (status == LQRHS_BLOCKED || status == LQRHS_NEED) {
+        // Needing more input only means the stream is blocked once the
+        // whole header block has been received.
+        if (status == LQRHS_BLOCKED || !hblock->missing)
+            decoder_block(self, hblock);
+        if (header_block_keep_input(hblock) < 0 ||
+            (!hblock->index && header_block_index_insert(&self->pending_blocks, hblock) < 0))
+            goto nomem;
+        if (hblock->missing)
+            Py_RETURN_NONE;
+        PyErr_Format(StreamBlocked, "stream %d is blocked", stream_id);
+        return NULL;
+    } else if (status != LQRHS_DONE) {
+        PyErr_Format(DecompressionFailed, "lsqpack_dec_header_read for stream %d failed", stream_id);
+        if (hblock->index)
+            header_block_index_remove(&self->pending_blocks, hblock);
+        header_block_release(&self->free_blocks, hblock);
+        return NULL;
+    }
+
+    if (hblock->index)
+        header_block_index_remove(&self->pending_blocks, hblock);
+    return decoder_header_done(self, hblock, dec_len);
+
+nomem:
+    lsqpack_dec_unref_stream(&self->dec, hblock);
+    if (hblock->index)
+        header_block_index_remove(&self->pending_blocks, hblock);
+    header_block_release(&self->free_blocks, hblock);
+    return PyErr_NoMemory();
+}
+
+PyDoc_STRVAR(Decoder_feed_header_chunk__doc__,
+    "feed_header_chunk(stream_id: int, data: bytes, header_size: int) -> "
+    "Optional[Tuple[bytes, List[Tuple[bytes, bytes]]]]\n\n"
+    "Decode part of a header block.\n\n"
+    "This allows decoding a header block as it arrives, instead of waiting "
+    "for all of it. Chunks are decoded as they are fed, and `None` is "
+    "returned until the last one, after which control data and headers are "
+    "returned as with :meth:`feed_header`.\n\n"
+    "If the stream is blocked once the whole header block was received, "
+    ":class:`StreamBlocked` is raised and decoding continues with "
+    ":meth:`resume_header`.\n\n"
+    "If the data cannot be processed, :class:`DecompressionFailed` is raised.\n\n"
+    ":param stream_id: the ID of the stream\n"
+    ":param data: the next chunk of the header block\n"
+    ":param header_size: the total size of the header block, which is the "
+    "length of the HEADERS frame, and must be the same for every chunk\n");
+
+static PyObject*
+Decoder_feed_header_chunk(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"stream_id", "data", "header_size", NULL};
+    PyObject *values[3];
+    uint64_t stream_id, header_size;
+    const unsigned char *data;
+    Py_ssize_t data_len;
+    PyObject *ref, *tuple;
+
+    if (parse_args("feed_header_chunk", kwlist, 3, 3, args, nargs, kwnames, values) < 0 ||
+        parse_uint64(values[0], "stream_id", &stream_id) < 0 ||
+        parse_uint64(values[2], "header_size", &header_size) < 0 ||
+        parse_bytes(values[1], &ref, &data, &data_len) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+    tuple = decoder_feed_header_chunk(self, stream_id, data, data_len, header_size);
+    RELEASE_LOCK(self);
+    Py_XDECREF(ref);
+
+    return decoder_deliver(self, stream_id, tuple);
+}
+
+static PyObject*
+decoder_resume_header(DecoderObject *self, uint64_t stream_id)
+{
+    size_t dec_len = DEC_BUF_SZ;
+    enum lsqpack_read_header_status status;
+    struct header_block *hblock;
+    PyThreadState *gil;
+
+    // find the header block for the stream
+    hblock = header_block_index_find(&self->pending_blocks, stream_id);
+    if (!hblock) {
+        PyErr_Format(PyExc_ValueError, "no pending header block for stream %d", stream_id);
+        return NULL;
+    }
+    if (hblock->missing) {
+        PyErr_Format(PyExc_ValueError, "the header block for stream %d is incomplete", stream_id);
+        return NULL;
+    }
+
+    if (hblock->blocked) {
+        status = LQRHS_BLOCKED;
+    } else {
+        gil = gil_release(hblock->data_end - hblock->data_ptr);
+        status = lsqpack_dec_header_read(
+            &self->dec,
+            hblock,
+            &hblock->data_ptr,
+            hblock->data_end - hblock->data_ptr,
+            self->dec_buf,
+            &dec_len
+        );
+        gil_restore(gil);
+    }
+
+    if (status == LQRHS_BLOCKED || status == LQRHS_NEED) {
+        decoder_block(self, hblock);
+        PyErr_Format(StreamBlocked, "stream %d is blocked", stream_id);
+        return NULL;
+    } else if (status != LQRHS_DONE) {
+        PyErr_Format(DecompressionFailed, "lsqpack_dec_header_read for stream %d failed (%d)", stream_id, status);
+        header_block_index_remove(&self->pending_blocks, hblock);
+        header_block_release(&self->free_blocks, hblock);
+        return NULL;
+    }
+
+    header_block_index_remove(&self->pending_blocks, hblock);
+
+    return decoder_header_done(self, hblock, dec_len);
+}
+
+PyDoc_STRVAR(Decoder_resume_header__doc__,
+    "resume_header(stream_id: int) -> Tuple[bytes, List[Tuple[bytes, bytes]]]\n\n"
+    "Continue decoding a header block and return control data and headers.\n\n"
+    "This method should be called only when :meth:`feed_encoder` indicates "
+    "that a stream has become unblocked\n\n"
+    ":param stream_id: the ID of the stream\n");
+
+static PyObject*
+Decoder_resume_header(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"stream_id", NULL};
+    PyObject *values[1];
+    uint64_t stream_id;
+    PyObject *tuple;
+
+    if (parse_args("resume_header", kwlist, 1, 1, args, nargs, kwnames, values) < 0 ||
+        parse_uint64(values[0], "stream_id", &stream_id) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+    tuple = decoder_resume_header(self, stream_id);
+    RELEASE_LOCK(self);
+
+    return tuple;
+}
+
+static PyObject*
+decoder_cancel_stream(DecoderObject *self, uint64_t stream_id)
+{
+    ssize_t dec_len;
+    struct header_block *hblock;
+
+    hblock = header_block_index_find(&self->pending_blocks, stream_id);
+    if (hblock) {
+        dec_len = lsqpack_dec_cancel_stream(&self->dec, hblock, self->dec_buf, DEC_BUF_SZ);
+        header_block_index_remove(&self->pending_blocks, hblock);
+        header_block_release(&self->free_blocks, hblock);
+        if (dec_len < 0) {
+            PyErr_Format(PyExc_RuntimeError, "lsqpack_dec_cancel_stream for stream %llu failed",
+                         (unsigned long long)stream_id);
+            return NULL;
+        }
+    } else if (self->max_table_capacity) {
+        // ls-qpack does not know about the stream, but the encoder may still
+        // hold references for a header block we never received.
+        dec_len = encode_prefix_int(self->dec_buf, 0x40, 6, stream_id);
+    } else {
+        dec_len = 0;
+    }
+    self->stats.decoder_stream_bytes += dec_len;
+
+    return decoder_control(self, dec_len);
+}
+
+PyDoc_STRVAR(Decoder_cancel_stream__doc__,
+    "cancel_stream(stream_id: int) -> bytes\n\n"
+    "Abandon decoding the header block for a stream and return control data.\n\n"
+    "This method should be called when a stream is reset or reading from it "
+    "is abandoned. Any pending header block for the stream is released, and "
+    "the Stream Cancellation instruction is returned.\n\n"
+    "For a stream without a pending header block, the instruction is only "
+    "returned if the decoder has a dynamic table, as the encoder cannot "
+    "otherwise hold references for the stream. Without one, `b\"\"` is "
+    "returned.\n\n"
+    ":param stream_id: the ID of the stream\n");
+
+static PyObject*
+Decoder_cancel_stream(DecoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"stream_id", NULL};
+    PyObject *values[1];
+    uint64_t stream_id;
+    PyObject *control;
+
+    if (parse_args("cancel_stream", kwlist, 1, 1, args, nargs, kwnames, values) < 0 ||
+        parse_uint64(values[0], "stream_id", &stream_id) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+    control = decoder_cancel_stream(self, stream_id);
+    RELEASE_LOCK(self);
+
+    return control;
+}
+
+PyDoc_STRVAR(Decoder_stats__doc__,
+    "stats() -> Dict[str, Union[int, float]]\n\n"
+    "Return cumulative statistics about the decoder.\n\n"
+    "- `blocked`: the number of header blocks which were blocked\n"
+    "- `decoder_stream_bytes`: the number of bytes emitted for the decoder stream\n"
+    "- `encoder_stream_bytes`: the number of bytes received on the encoder stream\n"
+    "- `header_block_bytes`: the number of bytes of header blocks received\n"
+    "- `header_bytes`: the total length of the decoded names and values\n"
+    "- `headers`: the number of decoded headers\n"
+    "- `pending_blocks`: the number of header blocks awaiting decoding\n"
+    "- `ratio`: the compression ratio reported by ls-qpack\n"
+    "- `table_capacity`: the capacity in bytes of the dynamic table\n"
+    "- `table_size`: the size in bytes of the entries in the dynamic table\n");
+
+static PyObject*
+Decoder_stats(DecoderObject *self, PyObject *Py_UNUSED(args))
+{
+    PyObject *dict;
+
+    ACQUIRE_LOCK(self);
+    dict = Py_BuildValue(
+        "{s:K,s:K,s:K,s:K,s:K,s:K,s:n,s:d,s:I,s:I}",
+        "blocked", self->stats.blocked,
+        "decoder_stream_bytes", self->stats.decoder_stream_bytes,
+        "encoder_stream_bytes", self->stats.encoder_stream_bytes,
+        "header_block_bytes", self->stats.header_block_bytes,
+        "header_bytes", self->stats.header_bytes,
+        "headers", self->stats.headers,
+        "pending_blocks", (Py_ssize_t)self->pending_blocks.count,
+        "ratio", (double)lsqpack_dec_ratio(&self->dec),
+        "table_capacity", self->dec.qpd_cur_max_capacity,
+        "table_size", self->dec.qpd_cur_capacity
+    );
+    RELEASE_LOCK(self);
+
+    return dict;
+}
+
+PyDoc_STRVAR(Decoder_flush_decoder_stream__doc__,
+    "flush_decoder_stream() -> bytes\n\n"
+    "Return the pending decoder stream data.\n\n"
+    "This is an Insert Count Increment instruction acknowledging the dynamic "
+    "table insertions which no Section Acknowledgment covered, preceded by "
+    "the instructions held back if the decoder coalesces its output. Calling "
+    "this once per burst of packets merges the increments into one.\n");
+
+static PyObject*
+Decoder_flush_decoder_stream(DecoderObject *self, PyObject *Py_UNUSED(args))
+{
+    unsigned char ici_buf[DEC_BUF_SZ];
+    ssize_t ici_len;
+    PyObject *data = NULL;
+
+    ACQUIRE_LOCK(self);
+    ici_len = lsqpack_dec_write_ici(&self->dec, ici_buf, sizeof(ici_buf));
+    if (ici_len < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_dec_write_ici failed");
+    } else {
+        self->stats.decoder_stream_bytes += ici_len;
+        if (buffer_reserve(&self->stream_buf, &self->stream_buf_sz, self->stream_buf_len + ici_len) < 0) {
+            PyErr_NoMemory();
+        } else {
+            memcpy(self->stream_buf + self->stream_buf_len, ici_buf, ici_len);
+            data = PyBytes_FromStringAndSize((const char*)self->stream_buf, self->stream_buf_len + ici_len);
+            if (data)
+                self->stream_buf_len = 0;
+        }
+    }
+    RELEASE_LOCK(self);
+
+    return data;
+}
+
+PyDoc_STRVAR(Decoder_memory_usage__doc__,
+    "memory_usage() -> int\n\n"
+    "Return the number of bytes of memory used by the decoder.\n\n"
+    "This includes the dynamic table and the header blocks which are pending "
+    "or kept for reuse, but not the Python objects returned by the decoder.\n");
+
+static PyObject*
+Decoder_memory_usage(DecoderObject *self, PyObject *Py_UNUSED(args))
+{
+    const struct header_block_index *index = &self->pending_blocks;
+    const struct header_block *hblock;
+    size_t size;
+
+    ACQUIRE_LOCK(self);
+    // lsqpack_dec_mem_used() counts the embedded decoder state itself.
+    size = sizeof(*self) - sizeof(self->dec) + lsqpack_dec_mem_used(&self->dec);
+    size += index->n_buckets * sizeof(*index->buckets);
+    for (size_t i = 0; i < index->n_buckets; ++i) {
+        for (hblock = index->buckets[i]; hblock; hblock = hblock->next)
+            size += header_block_mem_used(hblock);
+    }
+    size += self->free_blocks.bytes;
+    size += self->stream_buf_sz;
+    RELEASE_LOCK(self);
+
+    return PyLong_FromSize_t(size);
+}
+
+static PyMethodDef Decoder_methods[] = {
+    {"cancel_stream", (PyCFunction)Decoder_cancel_stream, METH_FASTCALL | METH_KEYWORDS, Decoder_cancel_stream__doc__},
+    {"feed_encoder", (PyCFunction)Decoder_feed_encoder, METH_FASTCALL | METH_KEYWORDS, Decoder_feed_encoder__doc__},
+    {"feed_header", (PyCFunction)Decoder_feed_header, METH_FASTCALL | METH_KEYWORDS, Decoder_feed_header__doc__},
+    {"feed_header_chunk", (PyCFunction)Decoder_feed_header_chunk, METH_FASTCALL | METH_KEYWORDS, Decoder_feed_header_chunk__doc__},
+    {"flush_decoder_stream", (PyCFunction)Decoder_flush_decoder_stream, METH_NOARGS, Decoder_flush_decoder_stream__doc__},
+    {"memory_usage", (PyCFunction)Decoder_memory_usage, METH_NOARGS, Decoder_memory_usage__doc__},
+    {"resume_header", (PyCFunction)Decoder_resume_header, METH_FASTCALL | METH_KEYWORDS, Decoder_resume_header__doc__},
+    {"stats", (PyCFunction)Decoder_stats, METH_NOARGS, Decoder_stats__doc__},
+    {NULL}
+};
+
+PyDoc_STRVAR(Decoder__doc__,
+    "Decoder(max_table_capacity: int, blocked_streams: int, *, lazy_headers: bool = False, "
+    "sink: Optional[Callable[[int, bytes, List[Tuple[bytes, bytes]]], None]] = None, "
+    "coalesce_decoder_stream: bool = False, http1_headers: bool = False, "
+    "validate_headers: bool = False)\n\n"
+    "QPACK decoder.\n\n"
+    "If a `sink` is given, it is called with the stream ID, control data and "
+    "headers of each decoded header block, instead of these being returned. "
+    "Blocked streams do not raise :class:`StreamBlocked`, and are decoded as "
+    "soon as :meth:`feed_encoder` unblocks them, so :meth:`resume_header` "
+    "is not needed.\n\n"
+    ":param max_table_capacity: the maximum size in bytes of the dynamic table\n"
+    ":param blocked_streams: the maximum number of streams that could be blocked\n"
+    ":param lazy_headers: if `True`, decoded headers are returned as a "
+    ":class:`HeaderList` instead of a list\n"
+    ":param sink: a callable which receives the decoded header blocks\n"
+    ":param coalesce_decoder_stream: if `True`, the methods return empty "
+    "control data, and the decoder stream instructions are held until "
+    ":meth:`flush_decoder_stream` is called\n"
+    ":param http1_headers: if `True`, decoded headers are returned as a "
+    "`(pseudo_headers, fields)` tuple, where `pseudo_headers` is a list of "
+    "`(name, value)` tuples and `fields` holds the other headers as HTTP/1.x "
+    "`name: value\\r\\n` lines. Headers containing CR, LF or NUL raise "
+    ":class:`HeaderValidationError`, whose `control` attribute holds the "
+    "control data to send to the encoder\n"
+    ":param validate_headers: if `True`, decoded headers are checked against "
+    "the rules of RFC 9114 Section 4.2, and :class:`HeaderValidationError` is "
+    "raised for invalid ones. Its `control` attribute holds the control "
+    "data to send to the encoder, as the header block is still acknowledged\n");
+
+static PyType_Slot DecoderType_slots[] = {
+    {Py_tp_dealloc, Decoder_dealloc},
+    {Py_tp_methods, Decoder_methods},
+    {Py_tp_doc, (char *)Decoder__doc__},
+    {Py_tp_init, Decoder_init},
+    {Py_tp_traverse, Decoder_traverse},
+    {Py_tp_clear, Decoder_clear},
+    {0, 0},
+};
+
+static PyType_Spec DecoderType_spec = {
+    MODULE_NAME ".Decoder",
+    sizeof(DecoderObject),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC,
+    DecoderType_slots
+};
+
+// HEADER NAME
+
+// The most entries the static table has for a single name (`:status`).
+#define HEADER_NAME_MAX_STATIC 14
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *name;
+    // The name's hash, computed as ls-qpack does.
+    uint32_t hash;
+    // The static table entries with this name.
+    unsigned char static_ids[HEADER_NAME_MAX_STATIC];
+    size_t n_static_ids;
+} HeaderNameObject;
+
+static int
+HeaderName_init(HeaderNameObject *self, PyObject *args, PyObject *kwargs)
+{
+    char *kwlist[] = {"name", NULL};
+    PyObject *name;
+    const char *data;
+    size_t len;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &name))
+        return -1;
+
+    // Accept the same types as the encoder does for names, but keep a
+    // private `bytes` copy so that the name cannot change afterwards.
+    if (PyBytes_Check(name)) {
+        Py_INCREF(name);
+    } else if (PyByteArray_Check(name) || PyMemoryView_Check(name)) {
+        name = PyBytes_FromObject(name);
+    } else if (PyUnicode_Check(name)) {
+        name = PyUnicode_AsASCIIString(name);
+        if (name == NULL) {
+            PyErr_SetString(PyExc_ValueError, "the header's name must be ASCII");
+            return -1;
+        }
+    } else {
+        PyErr_SetString(PyExc_TypeError, "the header's name must be bytes");
+        return -1;
+    }
+    if (name == NULL)
+        return -1;
+    data = PyBytes_AsString(name);
+    len = PyBytes_Size(name);
+    if (len == 0) {
+        Py_DECREF(name);
+        PyErr_SetString(PyExc_ValueError, "the header's name must not be empty");
+        return -1;
+    }
+
+    Py_XDECREF(self->name);
+    self->name = name;
+    self->hash = XXH32(data, len, LSQPACK_XXH_SEED);
+    self->n_static_ids = 0;
+    for (size_t i = 0; i < STATIC_TABLE_SIZE && self->n_static_ids < HEADER_NAME_MAX_STATIC; ++i) {
+        if (strlen(static_table_names[i]) == len && !memcmp(static_table_names[i], data, len))
+            self->static_ids[self->n_static_ids++] = (unsigned char)i;
+    }
+    return 0;
+}
+
+static void
+HeaderName_dealloc(HeaderNameObject *self)
+{
+    Py_XDECREF(self->name);
+
+    PyTypeObject *tp = Py_TYPE(self);
+    freefunc free = PyType_GetSlot(tp, Py_tp_free);
+    free(self);
+    Py_DECREF(tp);
+}
+
+static PyObject*
+HeaderName_repr(HeaderNameObject *self)
+{
+    return PyUnicode_FromFormat("HeaderName(%R)", self->name ? self->name : Py_None);
+}
+
+static PyMemberDef HeaderName_members[] = {
+    {"name", T_OBJECT, offsetof(HeaderNameObject, name), READONLY, "The header name."},
+    {NULL}
+};
+
+PyDoc_STRVAR(HeaderName__doc__,
+    "HeaderName(name: Union[bytes, bytearray, memoryview, str])\n\n"
+    "A header name prepared for being encoded repeatedly.\n\n"
+    "The name's hash and its entries in the static table are computed once, "
+    "so that :class:`Encoder` does not look them up every time. A "
+    "`HeaderName` can be used in place of `bytes` as the name of the "
+    "headers passed to :meth:`Encoder.encode`.\n\n"
+    ":param name: the header name, which is kept as `bytes`\n");
+
+static PyType_Slot HeaderNameType_slots[] = {
+    {Py_tp_dealloc, HeaderName_dealloc},
+    {Py_tp_doc, (char *)HeaderName__doc__},
+    {Py_tp_init, HeaderName_init},
+    {Py_tp_members, HeaderName_members},
+    {Py_tp_repr, HeaderName_repr},
+    {0, 0},
+};
+
+static PyType_Spec HeaderNameType_spec = {
+    MODULE_NAME ".HeaderName",
+    sizeof(HeaderNameObject),
+    0,
+    Py_TPFLAGS_DEFAULT,
+    HeaderNameType_slots
+};
+
+/**
+ * Return the HeaderName if a header name is one, otherwise NULL.
+ */
+static HeaderNameObject*
+header_name_check(PyObject *obj)
+{
+    if (Py_TYPE(obj) == (PyTypeObject *)HeaderNameType && ((HeaderNameObject *)obj)->name)
+        return (HeaderNameObject *)obj;
+    return NULL;
+}
+
+// ENCODER
+
+/**
+ * A header to encode, pointing into the memory of the caller's objects.
+ *
+ * A reference to the header's tuple is held, so that the memory remains
+ * valid while the GIL is released.
+ */
+struct encoder_header {
+    PyObject *tuple;
+    const HeaderNameObject *hint;
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+    int flags;
+};
+
+/**
+ * A header block to encode, made of `n_fields` consecutive headers.
+ *
+ * Once encoded, the header block is held in `hdr_buf` between `start`
+ * and `end`.
+ *
+ * If `no_blocking` is set, the block does not use the dynamic table, so
+ * that it cannot block the decoder. `at_risk` tells whether the encoded
+ * block references entries which the decoder has not acknowledged.
+ *
+ * If `discard` is set, the block is only encoded for the entries it
+ * inserts into the dynamic table, and is left out of the statistics.
+ */
+struct encoder_block {
+    uint64_t stream_id;
+    size_t n_fields;
+    size_t start;
+    size_t end;
+    int no_blocking;
+    int at_risk;
+    int discard;
+};
+
+/**
+ * The working memory of an encoding call.
+ *
+ * Encoders only hold these buffers while encoding, and otherwise return
+ * them to a pool shared by all encoders, so that idle encoders do not use
+ * any memory for them.
+ */
+struct encoder_buffers {
+    // The output buffers start small and grow as needed.
+    unsigned char *hdr_buf;
+    size_t hdr_buf_sz;
+    unsigned char *enc_buf;
+    size_t enc_buf_sz;
+    unsigned char *xhdr_buf;
+    size_t xhdr_buf_sz;
+    // The headers and header blocks being encoded.
+    struct encoder_header *fields;
+    size_t fields_sz;
+    struct encoder_block *blocks;
+    size_t blocks_sz;
+};
+
+// The number of released buffers kept for reuse, which bounds the memory
+// held by the pool to roughly this many concurrent encoding calls.
+#define ENCODER_BUFFERS_POOL_SIZE 16
+
+// Buffers which grew beyond this size are freed instead of being reused.
+#define ENCODER_BUFFERS_POOL_MAX_BUF 65536
+
+static struct {
+    PyThread_type_lock lock;
+    struct encoder_buffers *free[ENCODER_BUFFERS_POOL_SIZE];
+    size_t count;
+} encoder_buffers_pool;
+
+static void
+encoder_buffers_free(struct encoder_buffers *bufs)
+{
+    free(bufs->hdr_buf);
+    free(bufs->enc_buf);
+    free(bufs->xhdr_buf);
+    free(bufs->fields);
+    free(bufs->blocks);
+    free(bufs);
+}
+
+/**
+ * Take buffers from the pool, or allocate new ones.
+ *
+ * The pool's lock is only held to pop a pointer, so it is taken without
+ * releasing the GIL.
+ */
+static struct encoder_buffers*
+encoder_buffers_get(void)
+{
+    struct encoder_buffers *bufs = NULL;
+
+    PyThread_acquire_lock(encoder_buffers_pool.lock, WAIT_LOCK);
+    if (encoder_buffers_pool.count)
+        bufs = encoder_buffers_pool.free[--encoder_buffers_pool.count];
+    PyThread_release_lock(encoder_buffers_pool.lock);
+
+    if (!bufs) {
+        bufs = calloc(1, sizeof(*bufs));
+        if (!bufs)
+            return NULL;
+    }
+    if (buffer_reserve(&bufs->hdr_buf, &bufs->hdr_buf_sz, HDR_BUF_SZ) < 0 ||
+        buffer_reserve(&bufs->enc_buf, &bufs->enc_buf_sz, ENC_BUF_SZ) < 0 ||
+        buffer_reserve(&bufs->xhdr_buf, &bufs->xhdr_buf_sz, XHDR_BUF_SZ) < 0) {
+        encoder_buffers_free(bufs);
+        return NULL;
+    }
+    return bufs;
+}
+
+/**
+ * Return buffers to the pool, freeing those which grew too large.
+ */
+static void
+encoder_buffers_release(struct encoder_buffers *bufs)
+{
+    if (bufs->hdr_buf_sz > ENCODER_BUFFERS_POOL_MAX_BUF) {
+        free(bufs->hdr_buf);
+        bufs->hdr_buf = NULL;
+        bufs->hdr_buf_sz = 0;
+    }
+    if (bufs->enc_buf_sz > ENCODER_BUFFERS_POOL_MAX_BUF) {
+        free(bufs->enc_buf);
+        bufs->enc_buf = NULL;
+        bufs->enc_buf_sz = 0;
+    }
+    if (bufs->xhdr_buf_sz > ENCODER_BUFFERS_POOL_MAX_BUF) {
+        free(bufs->xhdr_buf);
+        bufs->xhdr_buf = NULL;
+        bufs->xhdr_buf_sz = 0;
+    }
+
+    PyThread_acquire_lock(encoder_buffers_pool.lock, WAIT_LOCK);
+    if (encoder_buffers_pool.count < ENCODER_BUFFERS_POOL_SIZE) {
+        encoder_buffers_pool.free[encoder_buffers_pool.count++] = bufs;
+        bufs = NULL;
+    }
+    PyThread_release_lock(encoder_buffers_pool.lock);
+
+    if (bufs)
+        encoder_buffers_free(bufs);
+}
+
+typedef struct {
+    PyObject_HEAD
+    PyThread_type_lock lock;
+    struct lsqpack_enc enc;
+    unsigned char pfx_buf[PREFIX_MAX_SIZE];
+    // The working memory of the current call, or NULL.
+    struct encoder_buffers *bufs;
+    // The headers being encoded by the current call.
+    size_t fields_bytes;
+    int fields_mutable;
+    // Temporary objects backing `fields`, released after each call.
+    PyObject *field_refs;
+    // The encoding flags for specific header names.
+    PyObject *header_flags;
+    struct {
+        unsigned long long at_risk;
+        unsigned long long decoder_stream_bytes;
+        unsigned long long dynamic_hits;
+        unsigned long long encoder_stream_bytes;
+        unsigned long long header_block_bytes;
+        unsigned long long header_bytes;
+        unsigned long long headers;
+        unsigned long long literals;
+        unsigned long long static_hits;
+    } stats;
+} EncoderObject;
+
+/**
+ * Take working memory for an encoding call from the pool.
+ */
+static int
+encoder_take_buffers(EncoderObject *self)
+{
+    self->bufs = encoder_buffers_get();
+    if (!self->bufs) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static void
+encoder_give_buffers(EncoderObject *self)
+{
+    encoder_buffers_release(self->bufs);
+    self->bufs = NULL;
+}
+
+static int
+Encoder_init(EncoderObject *self, PyObject *args, PyObject *kwargs)
+{
+    // See Decoder_init().
+    if (self->lock) {
+        PyErr_SetString(PyExc_RuntimeError, "the encoder is already initialized");
+        return -1;
+    }
+    self->lock = PyThread_allocate_lock();
+    if (!self->lock) {
+        PyErr_SetString(PyExc_MemoryError, "unable to allocate lock");
+        return -1;
+    }
+
+    lsqpack_enc_preinit(&self->enc, NULL);
+    return 0;
+}
+
+static void
+Encoder_dealloc(EncoderObject *self)
+{
+    lsqpack_enc_cleanup(&self->enc);
+
+    Py_XDECREF(self->field_refs);
+    Py_XDECREF(self->header_flags);
+
+    if (self->lock)
+        PyThread_free_lock(self->lock);
+
+    PyTypeObject *tp = Py_TYPE(self);
+    freefunc free = PyType_GetSlot(tp, Py_tp_free);
+    free(self);
+    Py_DECREF(tp);
+}
+
+PyDoc_STRVAR(Encoder_apply_settings__doc__,
+    "apply_settings(max_table_capacity: int, blocked_streams: int, *, "
+    "dynamic_table_capacity: Optional[int] = None, aggressive_indexing: bool = False) -> bytes\n\n"
+    "Apply the settings received from the encoder.\n\n"
+    ":param max_table_capacity: the maximum size in bytes of the dynamic table\n"
+    ":param blocked_streams: the maximum number of streams that could be blocked\n"
+    ":param dynamic_table_capacity: the size in bytes of the dynamic table to use, "
+    "which must not exceed `max_table_capacity`. Defaults to `max_table_capacity`.\n"
+    ":param aggressive_indexing: if `True`, insert headers into the dynamic "
+    "table the first time they are seen\n");
+
+static PyObject*
+Encoder_apply_settings(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"max_table_capacity", "blocked_streams", "dynamic_table_capacity",
+                                         "aggressive_indexing", NULL};
+    PyObject *values[4];
+    unsigned max_table_capacity, blocked_streams;
+    unsigned dynamic_table_capacity;
+    int aggressive_indexing = 0;
+    enum lsqpack_enc_opts opts = LSQPACK_ENC_OPT_STAGE_2;
+    unsigned char tsu_buf[LSQPACK_LONGEST_SDTC];
+    size_t tsu_len = sizeof(tsu_buf);
+    int ret;
+
+    if (parse_args("apply_settings", kwlist, 2, 2, args, nargs, kwnames, values) < 0 ||
+        parse_uint(values[0], "max_table_capacity", &max_table_capacity) < 0 ||
+        parse_uint(values[1], "blocked_streams", &blocked_streams) < 0)
+        return NULL;
+    if (values[3]) {
+        aggressive_indexing = PyObject_IsTrue(values[3]);
+        if (aggressive_indexing < 0)
+            return NULL;
+    }
+
+    if (values[2] == NULL || values[2] == Py_None) {
+        dynamic_table_capacity = max_table_capacity;
+    } else {
+        if (parse_uint(values[2], "dynamic_table_capacity", &dynamic_table_capacity) < 0)
+            return NULL;
+        if (dynamic_table_capacity > max_table_capacity) {
+            PyErr_SetString(PyExc_ValueError, "dynamic_table_capacity must not exceed max_table_capacity");
+            return NULL;
+        }
+    }
+    if (aggressive_indexing)
+        opts |= LSQPACK_ENC_OPT_IX_AGGR;
+
+    ACQUIRE_LOCK(self);
+    ret = lsqpack_enc_init(&self->enc, NULL, max_table_capacity, dynamic_table_capacity, blocked_streams,
+                           opts, tsu_buf, &tsu_len);
+    RELEASE_LOCK(self);
+    if (ret != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_init failed");
+        return NULL;
+    }
+
+    return PyBytes_FromStringAndSize((const char*)tsu_buf, tsu_len);
+}
+
+PyDoc_STRVAR(Encoder_set_max_capacity__doc__,
+    "set_max_capacity(capacity: int) -> bytes\n\n"
+    "Change the size of the dynamic table.\n\n"
+    "The resulting encoder stream data is returned. The capacity must not "
+    "exceed the `max_table_capacity` passed to :meth:`apply_settings`.\n\n"
+    ":param capacity: the size in bytes of the dynamic table\n");
+
+static PyObject*
+Encoder_set_max_capacity(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"capacity", NULL};
+    PyObject *values[1];
+    unsigned capacity;
+    unsigned char tsu_buf[LSQPACK_LONGEST_SDTC];
+    size_t tsu_len = sizeof(tsu_buf);
+    int ret;
+
+    if (parse_args("set_max_capacity", kwlist, 1, 1, args, nargs, kwnames, values) < 0 ||
+        parse_uint(values[0], "capacity", &capacity) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+    ret = lsqpack_enc_set_max_capacity(&self->enc, capacity, tsu_buf, &tsu_len);
+    RELEASE_LOCK(self);
+    if (ret != 0) {
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_set_max_capacity failed");
+        return NULL;
+    }
+
+    return PyBytes_FromStringAndSize((const char*)tsu_buf, tsu_len);
+}
+
+/**
+ * Get a pointer to the contents of a header name or value.
+ *
+ * `bytes`, `bytearray` and ASCII `str` objects are read in place. A
+ * `memoryview` is first copied to `bytes`, which is kept alive until
+ * `encoder_release_fields` is called.
+ */
+static int
+encoder_get_field(EncoderObject *self, PyObject *obj, const char **data, size_t *len)
+{
+    Py_ssize_t size;
+
+    if (PyBytes_Check(obj)) {
+        *data = PyBytes_AsString(obj);
+        *len = PyBytes_Size(obj);
+        return 0;
+#ifndef Py_GIL_DISABLED
+    } else if (PyByteArray_Check(obj)) {
+        // The contents could change if the GIL was released while encoding.
+        self->fields_mutable = 1;
+        *data = PyByteArray_AsString(obj);
+        *len = PyByteArray_Size(obj);
+        return 0;
+#endif
+    } else if (PyUnicode_Check(obj)) {
+        *data = PyUnicode_AsUTF8AndSize(obj, &size);
+        if (*data == NULL)
+            return -1;
+        for (Py_ssize_t i = 0; i < size; ++i) {
+            if ((unsigned char)(*data)[i] >= 0x80) {
+                PyErr_SetString(PyExc_ValueError, "the header's name and value must be ASCII");
+                return -1;
+            }
+        }
+        *len = size;
+        return 0;
+    } else if (PyMemoryView_Check(obj) || PyByteArray_Check(obj)) {
+        // Without the GIL, a bytearray could be resized by another thread
+        // while it is being read, so it is copied too.
+        if (!self->field_refs) {
+            self->field_refs = PyList_New(0);
+            if (!self->field_refs)
+                return -1;
+        }
+        obj = PyBytes_FromObject(obj);
+        if (obj == NULL)
+            return -1;
+        if (PyList_Append(self->field_refs, obj) < 0) {
+            Py_DECREF(obj);
+            return -1;
+        }
+        Py_DECREF(obj);
+        *data = PyBytes_AsString(obj);
+        *len = PyBytes_Size(obj);
+        return 0;
+    }
+
+    PyErr_SetString(PyExc_ValueError, "the header's name and value must be bytes");
+    return -1;
+}
+
+/**
+ * Release the references held for the first `n_fields` headers, and the
+ * temporary objects created by `encoder_get_field`.
+ */
+static void
+encoder_release_fields(EncoderObject *self, size_t n_fields)
+{
+    for (size_t i = 0; i < n_fields; ++i)
+        Py_DECREF(self->bufs->fields[i].tuple);
+    self->fields_bytes = 0;
+    self->fields_mutable = 0;
+    if (self->field_refs)
+        PyList_SetSlice(self->field_refs, 0, PyList_Size(self->field_refs), NULL);
+}
+
+/**
+ * Look up the encoding flags configured for a header name.
+ */
+static int
+encoder_get_flags(EncoderObject *self, PyObject *name, const struct encoder_header *field)
+{
+    PyObject *key, *value;
+
+    if (!self->header_flags || !PyDict_Size(self->header_flags))
+        return 0;
+
+    if (PyBytes_Check(name)) {
+        key = name;
+        Py_INCREF(key);
+    } else {
+        key = PyBytes_FromStringAndSize(field->name, field->name_len);
+        if (key == NULL)
+            return -1;
+    }
+    value = PyDict_GetItemWithError(self->header_flags, key);
+    Py_DECREF(key);
+    if (value == NULL)
+        return PyErr_Occurred() ? -1 : 0;
+    return (int)PyLong_AsLong(value);
+}
+
+/**
+ * Grow `fields` so that it holds at least `count` headers.
+ */
+static int
+encoder_reserve_fields(EncoderObject *self, size_t count)
+{
+    struct encoder_header *fields;
+    size_t fields_sz;
+
+    if (count <= self->bufs->fields_sz)
+        return 0;
+
+    fields_sz = self->bufs->fields_sz ? self->bufs->fields_sz : 16;
+    while (fields_sz < count)
+        fields_sz *= 2;
+    fields = realloc(self->bufs->fields, fields_sz * sizeof(*fields));
+    if (!fields) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->bufs->fields = fields;
+    self->bufs->fields_sz = fields_sz;
+    return 0;
+}
+
+static int
+encoder_load_header_list(EncoderObject *self, PyObject *list, size_t *n_fields, size_t *xhdr_max)
+{
+    PyObject *tuple, *name;
+    struct encoder_header *field;
+
+    if (encoder_reserve_fields(self, *n_fields + PyList_Size(list)) < 0)
+        return -1;
+
+    for (Py_ssize_t i = 0; i < PyList_Size(list); ++i) {
+        tuple = PyList_GetItem(list, i);
+        if (!PyTuple_Check(tuple) || PyTuple_Size(tuple) != 2) {
+            PyErr_SetString(PyExc_ValueError, "the header must be a two-tuple");
+            return -1;
+        }
+        field = &self->bufs->fields[*n_fields];
+        name = PyTuple_GetItem(tuple, 0);
+        field->hint = header_name_check(name);
+        if (field->hint)
+            name = field->hint->name;
+        if (encoder_get_field(self, name, &field->name, &field->name_len) < 0 ||
+            encoder_get_field(self, PyTuple_GetItem(tuple, 1), &field->value, &field->value_len) < 0)
+            return -1;
+        if (field->name_len == 0) {
+            PyErr_SetString(PyExc_ValueError, "the header's name must not be empty");
+            return -1;
+        }
+        // The offsets in lsxpack_header are limited to LSXPACK_MAX_STRLEN.
+        if (field->name_len + field->value_len > LSXPACK_MAX_STRLEN) {
+            PyErr_SetString(PyExc_ValueError, "the header's name and value are too long");
+            return -1;
+        }
+        if (field->name_len + field->value_len > *xhdr_max)
+            *xhdr_max = field->name_len + field->value_len;
+        field->flags = encoder_get_flags(self, name, field);
+        if (field->flags < 0)
+            return -1;
+        Py_INCREF(tuple);
+        field->tuple = tuple;
+        self->fields_bytes += field->name_len + field->value_len;
+        *n_fields += 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Validate a list of headers and append them to `fields`.
+ *
+ * `n_fields` is updated to the number of headers loaded so far and
+ * `xhdr_max` to the length of the longest header.
+ */
+static int
+encoder_load_headers(EncoderObject *self, PyObject *list, size_t *n_fields, size_t *xhdr_max)
+{
+    int ret;
+
+    if (!PyList_Check(list)) {
+        PyErr_SetString(PyExc_ValueError, "headers must be a list");
+        return -1;
+    }
+
+    BEGIN_CRITICAL_SECTION(list);
+    ret = encoder_load_header_list(self, list, n_fields, xhdr_max);
+    END_CRITICAL_SECTION();
+    return ret;
+}
+
+/**
+ * Point an lsxpack_header at a header's name and value.
+ *
+ * lsxpack_header addresses the name and value as offsets into a single
+ * buffer. If the value directly follows the name in the caller's memory,
+ * as it does for a header decoded by ls-qpack, that memory is used,
+ * otherwise both are copied into `xhdr_buf`.
+ */
+static void
+encoder_set_xhdr(EncoderObject *self, struct lsxpack_header *xhdr, const struct encoder_header *field)
+{
+    if (field->name + field->name_len == field->value) {
+        lsxpack_header_set_offset2(xhdr, field->name,
+                                   0, field->name_len,
+                                   field->name_len, field->value_len);
+    } else {
+        memcpy(self->bufs->xhdr_buf, field->name, field->name_len);
+        memcpy(self->bufs->xhdr_buf + field->name_len, field->value, field->value_len);
+        lsxpack_header_set_offset2(xhdr, (const char*)self->bufs->xhdr_buf,
+                                   0, field->name_len,
+                                   field->name_len, field->value_len);
+    }
+
+    // Pass on what is known about the name, so that ls-qpack does not
+    // hash it. A static table entry is only given if the value matches.
+    if (field->hint) {
+        xhdr->name_hash = field->hint->hash;
+        xhdr->flags |= LSXPACK_NAME_HASH;
+        for (size_t i = 0; i < field->hint->n_static_ids; ++i) {
+            const char *value = static_table_values[field->hint->static_ids[i]];
+            if (strlen(value) == field->value_len && !memcmp(value, field->value, field->value_len)) {
+                xhdr->qpack_index = field->hint->static_ids[i];
+                xhdr->flags |= LSXPACK_QPACK_IDX | LSXPACK_VAL_MATCHED;
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Update the statistics based on the representation of an encoded header,
+ * see RFC 9204 Section 4.5.
+ */
+static void
+encoder_count_header(EncoderObject *self, const struct encoder_header *field, unsigned char first)
+{
+    self->stats.headers++;
+    self->stats.header_bytes += field->name_len + field->value_len;
+    if ((first & 0xc0) == 0xc0)
+        self->stats.static_hits++;
+    else if ((first & 0xc0) == 0x80 || (first & 0xf0) == 0x10)
+        self->stats.dynamic_hits++;
+    else
+        self->stats.literals++;
+}
+
+enum encoder_error {
+    ENCODER_OK,
+    ENCODER_NO_MEMORY,
+    ENCODER_START_FAILED,
+    ENCODER_ENCODE_FAILED,
+    ENCODER_END_FAILED,
+};
+
+/**
+ * Encode a header block, appending it to `hdr_buf` at `*hdr_off`.
+ *
+ * The encoder stream data is appended to `enc_buf` at `*enc_off`, which
+ * allows several header blocks to share the encoder stream output.
+ *
+ * This does not touch any Python objects, so it can run without the GIL.
+ */
+static enum encoder_error
+encoder_encode_fields(EncoderObject *self, struct encoder_block *block,
+                      const struct encoder_header *fields, size_t *enc_off, size_t *hdr_off)
+{
+    unsigned seqno = 0;
+    size_t enc_len, hdr_len;
+    ssize_t pfx_len;
+    struct lsxpack_header xhdr;
+    enum lsqpack_enc_status status;
+    enum lsqpack_enc_flags flags;
+    enum lsqpack_enc_header_flags hflags;
+    enum encoder_error error;
+
+    // Leave room for the prefix, which is only known once all the headers
+    // have been encoded.
+    block->start = *hdr_off + PREFIX_MAX_SIZE;
+    if (buffer_reserve(&self->bufs->hdr_buf, &self->bufs->hdr_buf_sz, block->start) < 0)
+        return ENCODER_NO_MEMORY;
+
+    // Start the encoding transaction.
+    if (lsqpack_enc_start_header(&self->enc, block->stream_id, seqno) != 0)
+        return ENCODER_START_FAILED;
+
+    *hdr_off = block->start;
+    for (size_t i = 0; i < block->n_fields; ++i) {
+        encoder_set_xhdr(self, &xhdr, &fields[i]);
+        flags = fields[i].flags & ~ENC_FLAG_NEVER_INDEX;
+        if (fields[i].flags & ENC_FLAG_NEVER_INDEX) {
+            xhdr.flags |= LSXPACK_NEVER_INDEX;
+            flags |= LQEF_NO_INDEX;
+        }
+        // ls-qpack has no per-block limit on the blocking risk, so a block
+        // which must not block the decoder does not use the dynamic table.
+        if (block->no_blocking)
+            flags |= LQEF_NO_DYN;
+
+        // If an output buffer is too small, grow it and retry.
+        for (;;) {
+            enc_len = self->bufs->enc_buf_sz - *enc_off;
+            hdr_len = self->bufs->hdr_buf_sz - *hdr_off;
+            status = lsqpack_enc_encode(&self->enc,
+                                        self->bufs->enc_buf + *enc_off, &enc_len,
+                                        self->bufs->hdr_buf + *hdr_off, &hdr_len,
+                                        &xhdr,
+                                        flags);
+            if (status == LQES_NOBUF_ENC) {
+                if (buffer_reserve(&self->bufs->enc_buf, &self->bufs->enc_buf_sz, self->bufs->enc_buf_sz + 1) < 0) {
+                    error = ENCODER_NO_MEMORY;
+                    goto fail;
+                }
+            } else if (status == LQES_NOBUF_HEAD) {
+                if (buffer_reserve(&self->bufs->hdr_buf, &self->bufs->hdr_buf_sz, self->bufs->hdr_buf_sz + 1) < 0) {
+                    error = ENCODER_NO_MEMORY;
+                    goto fail;
+                }
+            } else {
+                break;
+            }
+        }
+        if (status != LQES_OK) {
+            error = ENCODER_ENCODE_FAILED;
+            goto fail;
+        }
+        if (hdr_len && !block->discard)
+            encoder_count_header(self, &fields[i], self->bufs->hdr_buf[*hdr_off]);
+        *enc_off += enc_len;
+        *hdr_off += hdr_len;
+        self->stats.encoder_stream_bytes += enc_len;
+    }
+
+    pfx_len = lsqpack_enc_end_header(&self->enc, self->pfx_buf, PREFIX_MAX_SIZE, &hflags);
+    if (pfx_len <= 0)
+        return ENCODER_END_FAILED;
+    block->start -= pfx_len;
+    block->end = *hdr_off;
+    memcpy(self->bufs->hdr_buf + block->start, self->pfx_buf, pfx_len);
+    block->at_risk = (hflags & LSQECH_REF_AT_RISK) != 0;
+    if (!block->discard) {
+        self->stats.header_block_bytes += block->end - block->start;
+        if (block->at_risk)
+            self->stats.at_risk++;
+    }
+
+    return ENCODER_OK;
+
+fail:
+    lsqpack_enc_end_header(&self->enc, self->pfx_buf, PREFIX_MAX_SIZE, NULL);
+    return error;
+}
+
+/**
+ * Attach the encoder stream data produced before an error to the exception,
+ * as `encoder_stream`. The dynamic table insertions cannot be undone, so
+ * this data must still be sent for the decoder to stay in sync.
+ */
+static void
+encoder_error_set_stream(EncoderObject *self, size_t enc_len)
+{
+    PyObject *exc_type, *exc_value, *exc_tb, *data;
+
+    PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+    PyErr_NormalizeException(&exc_type, &exc_value, &exc_tb);
+    data = PyBytes_FromStringAndSize((const char*)self->bufs->enc_buf, enc_len);
+    if (data == NULL || PyObject_SetAttrString(exc_value, "encoder_stream", data) < 0) {
+        Py_XDECREF(data);
+        Py_XDECREF(exc_type);
+        Py_XDECREF(exc_value);
+        Py_XDECREF(exc_tb);
+        return;
+    }
+    Py_DECREF(data);
+    PyErr_Restore(exc_type, exc_value, exc_tb);
+}
+
+/**
+ * Encode the header blocks for the loaded headers.
+ *
+ * The GIL is released while encoding, unless the headers are small or
+ * could be modified by another thread.
+ */
+static int
+encoder_encode_blocks(EncoderObject *self, struct encoder_block *blocks, size_t n_blocks,
+                      size_t xhdr_max, size_t *enc_len)
+{
+    const struct encoder_header *fields = self->bufs->fields;
+    enum encoder_error error = ENCODER_OK;
+    size_t hdr_off = 0;
+    PyThreadState *gil;
+
+    *enc_len = 0;
+    gil = self->fields_mutable ? NULL : gil_release(self->fields_bytes);
+    if (buffer_reserve(&self->bufs->xhdr_buf, &self->bufs->xhdr_buf_sz, xhdr_max) < 0)
+        error = ENCODER_NO_MEMORY;
+    for (size_t i = 0; i < n_blocks && error == ENCODER_OK; ++i) {
+        error = encoder_encode_fields(self, &blocks[i], fields, enc_len, &hdr_off);
+        fields += blocks[i].n_fields;
+    }
+    gil_restore(gil);
+
+    switch (error) {
+    case ENCODER_OK:
+        return 0;
+    case ENCODER_NO_MEMORY:
+        PyErr_NoMemory();
+        break;
+    case ENCODER_START_FAILED:
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_start_header failed");
+        break;
+    case ENCODER_ENCODE_FAILED:
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_encode failed");
+        break;
+    case ENCODER_END_FAILED:
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_end_header failed");
+        break;
+    }
+    encoder_error_set_stream(self, *enc_len);
+    return -1;
+}
+
+/**
+ * Return an encoded header block as `bytes`.
+ */
+static PyObject*
+encoder_block_bytes(EncoderObject *self, const struct encoder_block *block)
+{
+    return PyBytes_FromStringAndSize((const char*)self->bufs->hdr_buf + block->start, block->end - block->start);
+}
+
+/**
+ * Check the headers of a block against the rules of RFC 9114 Section 4.2.
+ */
+static int
+encoder_validate_fields(const struct encoder_header *fields, size_t n_fields)
+{
+    const char *error;
+    int regular = 0;
+
+    for (size_t i = 0; i < n_fields; ++i) {
+        error = header_check((const unsigned char *)fields[i].name, fields[i].name_len,
+                             (const unsigned char *)fields[i].value, fields[i].value_len, &regular);
+        if (error) {
+            PyErr_Format(HeaderValidationError, "header %zu: %s", i, error);
+            return -1;
+        }
+    }
+    return 0;
+}
+
 static PyObject*
-Decoder_feed_encoder(DecoderObject *self, PyObject *args, PyObject *kwargs)
+encoder_encode(EncoderObject *self, uint64_t stream_id, PyObject *list, int no_blocking, int report_at_risk,
+               int validate)
 {
-    char *kwlist[] = {"data", NULL};
-    const unsigned char *data;
-    Py_ssize_t data_len;
-    PyObject *list, *value;
-    struct header_block *hblock;
+    struct encoder_block block = {stream_id, 0, 0, 0, no_blocking, 0, 0};
+    PyObject *control, *data, *tuple;
+    size_t enc_len, xhdr_max = 0;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y#", kwlist, &data, &data_len))
-        return NULL;
-
-    if (lsqpack_dec_enc_in(&self->dec, data, data_len) < 0) {
-        PyErr_SetString(EncoderStreamError, "lsqpack_dec_enc_in failed");
+    // Validate all the input headers.
+    if (encoder_load_headers(self, list, &block.n_fields, &xhdr_max) < 0 ||
+        (validate && encoder_validate_fields(self->bufs->fields, block.n_fields) < 0) ||
+        encoder_encode_blocks(self, &block, 1, xhdr_max, &enc_len) < 0) {
+        encoder_release_fields(self, block.n_fields);
         return NULL;
     }
+    encoder_release_fields(self, block.n_fields);
 
-    list = PyList_New(0);
-    STAILQ_FOREACH(hblock, &self->pending_blocks, entries) {
-        if (!hblock->blocked) {
-            value = PyLong_FromUnsignedLongLong(hblock->stream_id);
-            PyList_Append(list, value);
-            Py_DECREF(value);
-        }
-    }
-    return list;
+    control = PyBytes_FromStringAndSize((const char*)self->bufs->enc_buf, enc_len);
+    data = encoder_block_bytes(self, &block);
+    if (report_at_risk)
+        tuple = Py_BuildValue("(NNO)", control, data, block.at_risk ? Py_True : Py_False);
+    else
+        tuple = Py_BuildValue("(NN)", control, data);
+
+    return tuple;
 }
 
-PyDoc_STRVAR(Decoder_feed_header__doc__,
-    "feed_header(stream_id: int, data: bytes) -> Tuple[bytes, List[Tuple[bytes, bytes]]]\n\n"
-    "Decode a header block and return control data and headers.\n\n"
-    "If the stream is blocked, :class:`StreamBlocked` is raised.\n\n"
-    "If the data cannot be processed, :class:`DecompressionFailed` is raised.\n\n"
-    ":param stream_id: the ID of the stream\n"
-    ":param data: the header block data\n");
+PyDoc_STRVAR(Encoder_encode__doc__,
+    "encode(stream_id: int, headers: List[Tuple[bytes, bytes]], *, "
+    "allow_blocking: bool = True, report_at_risk: bool = False, validate_headers: bool = False) "
+    "-> Tuple[bytes, bytes]\n\n"
+    "Encode a list of headers.\n\n"
+    "A tuple is returned containing two bytestrings: the encoder stream data "
+    " and the encoded header block. If `report_at_risk` is `True`, a third "
+    "item tells whether the header block references dynamic table entries "
+    "which the decoder has not acknowledged yet. The decoder blocks on such a "
+    "header block until it has received the encoder stream data, which "
+    "should then be sent first.\n\n"
+    "Header names and values can be `bytes`, `bytearray`, `memoryview` or "
+    "ASCII `str` objects.\n\n"
+    "If encoding fails, the exception has an `encoder_stream` attribute "
+    "holding the encoder stream data produced before the failure, which "
+    "must still be sent to the decoder.\n\n"
+    ":param stream_id: the stream ID\n"
+    ":param headers: a list of header tuples\n"
+    ":param allow_blocking: if `False`, the header block only uses the static "
+    "table and literals, so that it cannot block the decoder whatever the "
+    "`blocked_streams` setting and the other streams at risk\n"
+    ":param report_at_risk: if `True`, also return whether the header block "
+    "could block the decoder\n"
+    ":param validate_headers: if `True`, the headers are checked against the "
+    "rules of RFC 9114 Section 4.2, and :class:`HeaderValidationError` is "
+    "raised for invalid ones\n");
 
 static PyObject*
-Decoder_feed_header(DecoderObject *self, PyObject *args, PyObject *kwargs)
+Encoder_encode(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    char *kwlist[] = {"stream_id", "data", NULL};
+    static const char *const kwlist[] = {"stream_id", "headers", "allow_blocking", "report_at_risk",
+                                         "validate_headers", NULL};
+    PyObject *values[5];
     uint64_t stream_id;
-    const unsigned char *data;
-    Py_ssize_t data_len;
-    PyObject *control, *tuple;
-    size_t dec_len = DEC_BUF_SZ;
-    enum lsqpack_read_header_status status;
-    struct header_block *hblock;
+    int allow_blocking = 1, report_at_risk = 0, validate_headers = 0;
+    PyObject *tuple;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "Ky#", kwlist, &stream_id, &data, &data_len))
+    if (parse_args("encode", kwlist, 2, 2, args, nargs, kwnames, values) < 0 ||
+        parse_uint64(values[0], "stream_id", &stream_id) < 0)
+        return NULL;
+    if (values[2] && (allow_blocking = PyObject_IsTrue(values[2])) < 0)
+        return NULL;
+    if (values[3] && (report_at_risk = PyObject_IsTrue(values[3])) < 0)
+        return NULL;
+    if (values[4] && (validate_headers = PyObject_IsTrue(values[4])) < 0)
         return NULL;
 
-    // check there is no header block for the stream
-    STAILQ_FOREACH(hblock, &self->pending_blocks, entries) {
-        if (hblock->stream_id == stream_id) {
-            PyErr_Format(PyExc_ValueError, "a header block for stream %d already exists", stream_id);
-            return NULL;
-        }
+    ACQUIRE_LOCK(self);
+    if (encoder_take_buffers(self) < 0) {
+        tuple = NULL;
+    } else {
+        tuple = encoder_encode(self, stream_id, values[1], !allow_blocking, report_at_risk, validate_headers);
+        encoder_give_buffers(self);
     }
-    hblock = header_block_new(stream_id, data, data_len);
+    RELEASE_LOCK(self);
 
-    status = lsqpack_dec_header_in(
-        &self->dec,
-        hblock,
-        stream_id,
-        hblock->data_len,
-        &hblock->data_ptr,
-        hblock->data_len,
-        self->dec_buf,
-        &dec_len
-    );
+    return tuple;
+}
 
-    if (status == LQRHS_BLOCKED || status == LQRHS_NEED) {
-        hblock->blocked = 1;
-        STAILQ_INSERT_TAIL(&self->pending_blocks, hblock, entries);
-        PyErr_Format(StreamBlocked, "stream %d is blocked", stream_id);
-        return NULL;
-    } else if (status != LQRHS_DONE) {
-        PyErr_Format(DecompressionFailed, "lsqpack_dec_header_in for stream %d failed", stream_id);
-        header_block_free(hblock);
-        return NULL;
+static int
+encoder_load_item_list(EncoderObject *self, PyObject *items, int no_blocking, size_t *n_fields, size_t *xhdr_max)
+{
+    PyObject *item;
+    struct encoder_block *block;
+    size_t count = PyList_Size(items), blocks_sz;
+
+    if (count > self->bufs->blocks_sz) {
+        blocks_sz = self->bufs->blocks_sz ? self->bufs->blocks_sz : 16;
+        while (blocks_sz < count)
+            blocks_sz *= 2;
+        block = realloc(self->bufs->blocks, blocks_sz * sizeof(*block));
+        if (!block) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        self->bufs->blocks = block;
+        self->bufs->blocks_sz = blocks_sz;
     }
 
-    control = PyBytes_FromStringAndSize((const char*)self->dec_buf, dec_len);
-    tuple = PyTuple_Pack(2, control, hblock->headers);
-    Py_DECREF(control);
-
-    header_block_free(hblock);
+    for (size_t i = 0; i < count; ++i) {
+        item = PyList_GetItem(items, i);
+        if (!PyTuple_Check(item) || PyTuple_Size(item) != 2 || !PyLong_Check(PyTuple_GetItem(item, 0))) {
+            PyErr_SetString(PyExc_ValueError, "the item must be a (stream_id, headers) tuple");
+            return -1;
+        }
+        block = &self->bufs->blocks[i];
+        block->stream_id = PyLong_AsUnsignedLongLong(PyTuple_GetItem(item, 0));
+        if (PyErr_Occurred())
+            return -1;
+        block->no_blocking = no_blocking;
+        block->at_risk = 0;
+        block->discard = 0;
+        block->n_fields = *n_fields;
+        if (encoder_load_headers(self, PyTuple_GetItem(item, 1), n_fields, xhdr_max) < 0)
+            return -1;
+        block->n_fields = *n_fields - block->n_fields;
+    }
 
-    return tuple;
+    return 0;
 }
 
-PyDoc_STRVAR(Decoder_resume_header__doc__,
-    "resume_header(stream_id: int) -> Tuple[bytes, List[Tuple[bytes, bytes]]]\n\n"
-    "Continue decoding a header block and return control data and headers.\n\n"
-    "This method should be called only when :meth:`feed_encoder` indicates "
-    "that a stream has become unblocked\n\n"
-    ":param stream_id: the ID of the stream\n");
-
 static PyObject*
-Decoder_resume_header(DecoderObject *self, PyObject *args, PyObject *kwargs)
+encoder_encode_many(EncoderObject *self, PyObject *items, int no_blocking)
 {
-    char *kwlist[] = {"stream_id", NULL};
-    uint64_t stream_id;
-    PyObject *control, *tuple;
-    size_t dec_len = DEC_BUF_SZ;
-    enum lsqpack_read_header_status status;
-    struct header_block *hblock;
-    int found = 0;
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "K", kwlist, &stream_id))
+    PyObject *blocks, *control, *data, *tuple;
+    size_t enc_len, n_fields = 0, xhdr_max = 0;
+    Py_ssize_t count;
+    int ret;
+
+    // Validate all the items before touching the encoder state.
+    if (!PyList_Check(items)) {
+        PyErr_SetString(PyExc_ValueError, "items must be a list");
         return NULL;
-
-    // find the header block for the stream
-    STAILQ_FOREACH(hblock, &self->pending_blocks, entries) {
-        if (hblock->stream_id == stream_id) {
-            found = 1;
-            break;
-        }
     }
-    if (!found) {
-        PyErr_Format(PyExc_ValueError, "no pending header block for stream %d", stream_id);
+    BEGIN_CRITICAL_SECTION(items);
+    count = PyList_Size(items);
+    ret = encoder_load_item_list(self, items, no_blocking, &n_fields, &xhdr_max);
+    END_CRITICAL_SECTION();
+    if (ret < 0 || encoder_encode_blocks(self, self->bufs->blocks, count, xhdr_max, &enc_len) < 0) {
+        encoder_release_fields(self, n_fields);
         return NULL;
     }
+    encoder_release_fields(self, n_fields);
 
-    if (hblock->blocked) {
-        status = LQRHS_BLOCKED;
-    } else {
-        status = lsqpack_dec_header_read(
-            &self->dec,
-            hblock,
-            &hblock->data_ptr,
-            hblock->data_len - (hblock->data_ptr - hblock->data),
-            self->dec_buf,
-            &dec_len
-        );
-    }
-
-    if (status == LQRHS_BLOCKED || status == LQRHS_NEED) {
-        hblock->blocked = 1;
-        PyErr_Format(StreamBlocked, "stream %d is blocked", stream_id);
-        return NULL;
-    } else if (status != LQRHS_DONE) {
-        PyErr_Format(DecompressionFailed, "lsqpack_dec_header_read for stream %d failed (%d)", stream_id, status);
-        STAILQ_REMOVE(&self->pending_blocks, hblock, header_block, entries);
-        header_block_free(hblock);
+    blocks = PyList_New(count);
+    if (blocks == NULL)
         return NULL;
+    for (Py_ssize_t i = 0; i < count; ++i) {
+        data = encoder_block_bytes(self, &self->bufs->blocks[i]);
+        if (data == NULL) {
+            Py_DECREF(blocks);
+            return NULL;
+        }
+        PyList_SetItem(blocks, i, data);
     }
 
-    control = PyBytes_FromStringAndSize((const char*)self->dec_buf, dec_len);
-    tuple = PyTuple_Pack(2, control, hblock->headers);
+    control = PyBytes_FromStringAndSize((const char*)self->bufs->enc_buf, enc_len);
+    tuple = PyTuple_Pack(2, control, blocks);
     Py_DECREF(control);
-
-    STAILQ_REMOVE(&self->pending_blocks, hblock, header_block, entries);
-    header_block_free(hblock);
+    Py_DECREF(blocks);
 
     return tuple;
 }
 
-static PyMethodDef Decoder_methods[] = {
-    {"feed_encoder", (PyCFunction)Decoder_feed_encoder, METH_VARARGS | METH_KEYWORDS, Decoder_feed_encoder__doc__},
-    {"feed_header", (PyCFunction)Decoder_feed_header, METH_VARARGS | METH_KEYWORDS, Decoder_feed_header__doc__},
-    {"resume_header", (PyCFunction)Decoder_resume_header, METH_VARARGS | METH_KEYWORDS, Decoder_resume_header__doc__},
-    {NULL}
-};
-
-PyDoc_STRVAR(Decoder__doc__,
-    "Decoder(max_table_capacity: int, blocked_streams: int)\n\n"
-    "QPACK decoder.\n\n"
-    ":param max_table_capacity: the maximum size in bytes of the dynamic table\n"
-    ":param blocked_streams: the maximum number of streams that could be blocked\n");
+PyDoc_STRVAR(Encoder_encode_many__doc__,
+    "encode_many(items: List[Tuple[int, List[Tuple[bytes, bytes]]]], *, allow_blocking: bool = True) "
+    "-> Tuple[bytes, List[bytes]]\n\n"
+    "Encode the headers for several streams.\n\n"
+    "This is equivalent to calling :meth:`encode` for each item, but avoids "
+    "the per-call overhead.\n\n"
+    "A tuple is returned containing the encoder stream data for all the "
+    "streams and a list with the encoded header block for each stream.\n\n"
+    "The headers of all the items are validated before any is encoded. If "
+    "encoding fails nonetheless, the exception has an `encoder_stream` "
+    "attribute holding the encoder stream data for the blocks encoded so "
+    "far, which must still be sent to the decoder.\n\n"
+    ":param items: a list of `(stream_id, headers)` tuples\n"
+    ":param allow_blocking: if `False`, the header blocks only use the static "
+    "table and literals, as with :meth:`encode`\n");
 
-static PyType_Slot DecoderType_slots[] = {
-    {Py_tp_dealloc, Decoder_dealloc},
-    {Py_tp_methods, Decoder_methods},
-    {Py_tp_doc, (char *)Decoder__doc__},
-    {Py_tp_init, Decoder_init},
-    {0, 0},
-};
+static PyObject*
+Encoder_encode_many(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"items", "allow_blocking", NULL};
+    PyObject *values[2];
+    PyObject *tuple;
+    int allow_blocking = 1;
 
-static PyType_Spec DecoderType_spec = {
-    MODULE_NAME ".Decoder",
-    sizeof(DecoderObject),
-    0,
-    Py_TPFLAGS_DEFAULT,
-    DecoderType_slots
-};
+    if (parse_args("encode_many", kwlist, 1, 1, args, nargs, kwnames, values) < 0)
+        return NULL;
+    if (values[1] && (allow_blocking = PyObject_IsTrue(values[1])) < 0)
+        return NULL;
 
-// ENCODER
+    ACQUIRE_LOCK(self);
+    if (encoder_take_buffers(self) < 0) {
+        tuple = NULL;
+    } else {
+        tuple = encoder_encode_many(self, values[0], !allow_blocking);
+        encoder_give_buffers(self);
+    }
+    RELEASE_LOCK(self);
 
-typedef struct {
-    PyObject_HEAD
-    struct lsqpack_enc enc;
-    unsigned char hdr_buf[HDR_BUF_SZ];
-    unsigned char enc_buf[ENC_BUF_SZ];
-    unsigned char pfx_buf[PREFIX_MAX_SIZE];
-    char xhdr_buf[XHDR_BUF_SZ];
-} EncoderObject;
+    return tuple;
+}
 
+/**
+ * Release the references held for a stream's header blocks, by feeding
+ * ls-qpack a Stream Cancellation instruction as if the decoder had sent it.
+ */
 static int
-Encoder_init(EncoderObject *self, PyObject *args, PyObject *kwargs)
+encoder_cancel_stream(EncoderObject *self, uint64_t stream_id)
 {
-    lsqpack_enc_preinit(&self->enc, NULL);
+    unsigned char buf[PREFIX_INT_MAX_SIZE];
+    size_t len = encode_prefix_int(buf, 0x40, 6, stream_id);
+
+    if (lsqpack_enc_decoder_in(&self->enc, buf, len) < 0) {
+        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_decoder_in failed");
+        return -1;
+    }
     return 0;
 }
 
-static void
-Encoder_dealloc(EncoderObject *self)
+PyDoc_STRVAR(Encoder_cancel_stream__doc__,
+    "cancel_stream(stream_id: int) -> None\n\n"
+    "Release the header blocks encoded for a stream.\n\n"
+    "This method should be called when a stream is reset before its header "
+    "block was sent, as the decoder will then never acknowledge it. Stream "
+    "Cancellation instructions sent by the decoder are handled by "
+    ":meth:`feed_decoder`.\n\n"
+    ":param stream_id: the ID of the stream\n");
+
+static PyObject*
+Encoder_cancel_stream(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    lsqpack_enc_cleanup(&self->enc);
+    static const char *const kwlist[] = {"stream_id", NULL};
+    PyObject *values[1];
+    uint64_t stream_id;
+    int ret;
 
-    PyTypeObject *tp = Py_TYPE(self);
-    freefunc free = PyType_GetSlot(tp, Py_tp_free);
-    free(self);
-    Py_DECREF(tp);
+    if (parse_args("cancel_stream", kwlist, 1, 1, args, nargs, kwnames, values) < 0 ||
+        parse_uint64(values[0], "stream_id", &stream_id) < 0)
+        return NULL;
+
+    ACQUIRE_LOCK(self);
+    ret = encoder_cancel_stream(self, stream_id);
+    RELEASE_LOCK(self);
+    if (ret < 0)
+        return NULL;
+
+    Py_RETURN_NONE;
 }
 
-PyDoc_STRVAR(Encoder_apply_settings__doc__,
-    "apply_settings(max_table_capacity: int, blocked_streams: int) -> bytes\n\n"
-    "Apply the settings received from the encoder.\n\n"
-    ":param max_table_capacity: the maximum size in bytes of the dynamic table\n"
-    ":param blocked_streams: the maximum number of streams that could be blocked\n");
+// The stream on which Encoder.prime() encodes its header blocks, which is
+// the highest stream ID and is never reached by a connection in practice.
+#define PRIME_STREAM_ID ((1ULL << 62) - 1)
 
 static PyObject*
-Encoder_apply_settings(EncoderObject *self, PyObject *args, PyObject *kwargs)
+encoder_prime(EncoderObject *self, PyObject *list)
 {
-    char *kwlist[] = {"max_table_capacity", "blocked_streams", NULL};
-    unsigned max_table_capacity, blocked_streams;
-    unsigned char tsu_buf[LSQPACK_LONGEST_SDTC];
-    size_t tsu_len = sizeof(tsu_buf);
+    struct encoder_block blocks[2];
+    size_t enc_len, n_fields = 0, xhdr_max = 0;
+    int ret = 0;
+
+    // ls-qpack inserts a header into the dynamic table once its history
+    // shows it was seen before, so the headers are loaded twice.
+    for (size_t i = 0; i < 2 && ret == 0; ++i) {
+        memset(&blocks[i], 0, sizeof(blocks[i]));
+        blocks[i].stream_id = PRIME_STREAM_ID;
+        blocks[i].discard = 1;
+        blocks[i].n_fields = n_fields;
+        ret = encoder_load_headers(self, list, &n_fields, &xhdr_max);
+        blocks[i].n_fields = n_fields - blocks[i].n_fields;
+    }
+    if (ret < 0) {
+        encoder_release_fields(self, n_fields);
+        return NULL;
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "II", kwlist, &max_table_capacity, &blocked_streams))
+    ret = encoder_encode_blocks(self, blocks, 2, xhdr_max, &enc_len);
+    encoder_release_fields(self, n_fields);
+    if (ret < 0)
         return NULL;
 
-    if (lsqpack_enc_init(&self->enc, NULL, max_table_capacity, max_table_capacity, blocked_streams,
-                         LSQPACK_ENC_OPT_STAGE_2, tsu_buf, &tsu_len) != 0) {
-        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_init failed");
+    // Release the references which the discarded blocks hold, as the decoder
+    // never acknowledges them.
+    if (encoder_cancel_stream(self, PRIME_STREAM_ID) < 0)
         return NULL;
-    }
 
-    return PyBytes_FromStringAndSize((const char*)tsu_buf, tsu_len);
+    return PyBytes_FromStringAndSize((const char*)self->bufs->enc_buf, enc_len);
 }
 
-PyDoc_STRVAR(Encoder_encode__doc__,
-    "encode(stream_id: int, headers: List[Tuple[bytes, bytes]]) -> Tuple[bytes, bytes]\n\n"
-    "Encode a list of headers.\n\n"
-    "A tuple is returned containing two bytestrings: the encoder stream data "
-    " and the encoded header block.\n\n"
-    ":param stream_id: the stream ID\n"
+PyDoc_STRVAR(Encoder_prime__doc__,
+    "prime(headers: List[Tuple[bytes, bytes]]) -> bytes\n\n"
+    "Insert headers into the dynamic table ahead of their first use, and "
+    "return the encoder stream data.\n\n"
+    "This lets the first header blocks of a connection reference common "
+    "headers instead of sending them as literals. It should be called after "
+    ":meth:`apply_settings`, and the encoder stream data sent before any "
+    "header block. Headers which do not fit in the dynamic table, or which "
+    "have flags preventing their insertion, are skipped.\n\n"
     ":param headers: a list of header tuples\n");
 
 static PyObject*
-Encoder_encode(EncoderObject *self, PyObject *args, PyObject *kwargs)
+Encoder_prime(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    char *kwlist[] = {"stream_id", "headers", NULL};
-    uint64_t stream_id;
-    unsigned seqno = 0;
-    PyObject *list, *tuple, *name, *value;
-    size_t enc_len, hdr_len, pfx_len;
-    size_t enc_off = 0, hdr_off = PREFIX_MAX_SIZE, pfx_off = 0;
-    struct lsxpack_header xhdr;
-    size_t name_len, value_len;
+    static const char *const kwlist[] = {"headers", NULL};
+    PyObject *values[1];
+    PyObject *data;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "KO", kwlist, &stream_id, &list))
+    if (parse_args("prime", kwlist, 1, 1, args, nargs, kwnames, values) < 0)
         return NULL;
 
-    // Validate all the input headers.
-    if (!PyList_Check(list)) {
-        PyErr_SetString(PyExc_ValueError, "headers must be a list");
-        return NULL;
+    ACQUIRE_LOCK(self);
+    if (encoder_take_buffers(self) < 0) {
+        data = NULL;
+    } else {
+        data = encoder_prime(self, values[0]);
+        encoder_give_buffers(self);
     }
+    RELEASE_LOCK(self);
 
-    for (Py_ssize_t i = 0; i < PyList_Size(list); ++i) {
-        tuple = PyList_GetItem(list, i);
-        if (!PyTuple_Check(tuple) || PyTuple_Size(tuple) != 2) {
-            PyErr_SetString(PyExc_ValueError, "the header must be a two-tuple");
-            return NULL;
-        }
-        name = PyTuple_GetItem(tuple, 0);
-        value = PyTuple_GetItem(tuple, 1);
-        if (!PyBytes_Check(name) || !PyBytes_Check(value)) {
-            PyErr_SetString(PyExc_ValueError, "the header's name and value must be bytes");
-            return NULL;
-        }
-        name_len = PyBytes_Size(name);
-        value_len = PyBytes_Size(value);
-        if (name_len == 0) {
-            PyErr_SetString(PyExc_ValueError, "the header's name must not be empty");
-            return NULL;
-        }
-        if (name_len + value_len > XHDR_BUF_SZ) {
-            PyErr_SetString(PyExc_ValueError, "the header's name and value are too long");
-            return NULL;
-        }
-    }
+    return data;
+}
 
-    // Start the encoding transaction.
-    if (lsqpack_enc_start_header(&self->enc, stream_id, seqno) != 0) {
-        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_start_header failed");
+PyDoc_STRVAR(Encoder_set_header_flags__doc__,
+    "set_header_flags(name: bytes, flags: int) -> None\n\n"
+    "Set the encoding flags for all headers with the given name.\n\n"
+    "The flags are a combination of :data:`NO_INDEX`, :data:`NEVER_INDEX`, "
+    ":data:`NO_DYNAMIC` and :data:`NO_HISTORY`. Passing `0` restores the "
+    "default behaviour.\n\n"
+    ":param name: the header name\n"
+    ":param flags: the encoding flags\n");
+
+static PyObject*
+Encoder_set_header_flags(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    static const char *const kwlist[] = {"name", "flags", NULL};
+    PyObject *values[2];
+    PyObject *name, *value;
+    long flags;
+    int ret;
+
+    if (parse_args("set_header_flags", kwlist, 2, 2, args, nargs, kwnames, values) < 0)
+        return NULL;
+    name = values[0];
+    if (!PyBytes_Check(name)) {
+        PyErr_SetString(PyExc_TypeError, "name must be bytes");
         return NULL;
     }
+    flags = PyLong_AsLong(values[1]);
+    if (flags == -1 && PyErr_Occurred())
+        return NULL;
 
-    for (Py_ssize_t i = 0; i < PyList_Size(list); ++i) {
-        tuple = PyList_GetItem(list, i);
-        name = PyTuple_GetItem(tuple, 0);
-        value = PyTuple_GetItem(tuple, 1);
-        name_len = PyBytes_Size(name);
-        value_len = PyBytes_Size(value);
-
-        // Copy the header name and value into the xhdr buffer.
-        memcpy(self->xhdr_buf, PyBytes_AsString(name), name_len);
-        memcpy(self->xhdr_buf + name_len, PyBytes_AsString(value), value_len);
-        lsxpack_header_set_offset2(&xhdr, self->xhdr_buf, 0, name_len, name_len, value_len);
-
-        enc_len = ENC_BUF_SZ - enc_off;
-        hdr_len = HDR_BUF_SZ - hdr_off;
-        if (lsqpack_enc_encode(&self->enc,
-                               self->enc_buf + enc_off, &enc_len,
-                               self->hdr_buf + hdr_off, &hdr_len,
-                               &xhdr,
-                               0) != LQES_OK) {
-            PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_encode failed");
-            lsqpack_enc_end_header(&self->enc, self->pfx_buf, PREFIX_MAX_SIZE, NULL);
-            return NULL;
-        }
-        enc_off += enc_len;
-        hdr_off += hdr_len;
+    if (flags & ~ENC_FLAGS_MASK) {
+        PyErr_SetString(PyExc_ValueError, "invalid encoding flags");
+        return NULL;
     }
 
-    pfx_len = lsqpack_enc_end_header(&self->enc, self->pfx_buf, PREFIX_MAX_SIZE, NULL);
-    if (pfx_len <= 0) {
-        PyErr_SetString(PyExc_RuntimeError, "lsqpack_enc_end_header failed");
+    value = PyLong_FromLong(flags);
+    if (value == NULL)
         return NULL;
-    }
-    pfx_off = PREFIX_MAX_SIZE - pfx_len;
-    memcpy(self->hdr_buf + pfx_off, self->pfx_buf, pfx_len);
 
-    name = PyBytes_FromStringAndSize((const char*)self->enc_buf, enc_off);
-    value = PyBytes_FromStringAndSize((const char*)self->hdr_buf + pfx_off, hdr_off - pfx_off);
-    tuple = PyTuple_Pack(2, name, value);
-    Py_DECREF(name);
+    ACQUIRE_LOCK(self);
+    if (!self->header_flags)
+        self->header_flags = PyDict_New();
+    if (!self->header_flags) {
+        ret = -1;
+    } else if (flags) {
+        ret = PyDict_SetItem(self->header_flags, name, value);
+    } else if (PyDict_GetItemWithError(self->header_flags, name)) {
+        ret = PyDict_DelItem(self->header_flags, name);
+    } else {
+        ret = PyErr_Occurred() ? -1 : 0;
+    }
+    RELEASE_LOCK(self);
     Py_DECREF(value);
+    if (ret < 0)
+        return NULL;
 
-    return tuple;
+    Py_RETURN_NONE;
 }
 
 PyDoc_STRVAR(Encoder_feed_decoder__doc__,
@@ -522,16 +3341,27 @@ PyDoc_STRVAR(Encoder_feed_decoder__doc__,
     ":param data: the decoder stream data\n");
 
 static PyObject*
-Encoder_feed_decoder(EncoderObject *self, PyObject *args, PyObject *kwargs)
+Encoder_feed_decoder(EncoderObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
 {
-    char *kwlist[] = {"data", NULL};
+    static const char *const kwlist[] = {"data", NULL};
+    PyObject *values[1], *ref;
     const unsigned char *data;
     Py_ssize_t data_len;
+    PyThreadState *gil;
+    int ret;
 
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "y#", kwlist, &data, &data_len))
+    if (parse_args("feed_decoder", kwlist, 1, 1, args, nargs, kwnames, values) < 0 ||
+        parse_bytes(values[0], &ref, &data, &data_len) < 0)
         return NULL;
 
-    if (lsqpack_enc_decoder_in(&self->enc, data, data_len) < 0) {
+    ACQUIRE_LOCK(self);
+    self->stats.decoder_stream_bytes += data_len;
+    gil = gil_release(data_len);
+    ret = lsqpack_enc_decoder_in(&self->enc, data, data_len);
+    gil_restore(gil);
+    RELEASE_LOCK(self);
+    Py_XDECREF(ref);
+    if (ret < 0) {
         PyErr_SetString(DecoderStreamError, "lsqpack_enc_decoder_in failed");
         return NULL;
     }
@@ -539,10 +3369,80 @@ Encoder_feed_decoder(EncoderObject *self, PyObject *args, PyObject *kwargs)
     Py_RETURN_NONE;
 }
 
+PyDoc_STRVAR(Encoder_stats__doc__,
+    "stats() -> Dict[str, Union[int, float]]\n\n"
+    "Return cumulative statistics about the encoder.\n\n"
+    "- `at_risk`: the number of header blocks which could block the decoder\n"
+    "- `decoder_stream_bytes`: the number of bytes received on the decoder stream\n"
+    "- `dynamic_hits`: the number of headers encoded as a dynamic table reference\n"
+    "- `encoder_stream_bytes`: the number of bytes emitted for the encoder stream\n"
+    "- `header_block_bytes`: the number of bytes of header blocks emitted\n"
+    "- `header_bytes`: the total length of the encoded names and values\n"
+    "- `headers`: the number of encoded headers\n"
+    "- `literals`: the number of headers encoded with a literal value\n"
+    "- `ratio`: the compression ratio reported by ls-qpack\n"
+    "- `static_hits`: the number of headers encoded as a static table reference\n"
+    "- `table_capacity`: the capacity in bytes of the dynamic table\n"
+    "- `table_entries`: the number of entries in the dynamic table\n"
+    "- `table_size`: the size in bytes of the entries in the dynamic table\n");
+
+static PyObject*
+Encoder_stats(EncoderObject *self, PyObject *Py_UNUSED(args))
+{
+    PyObject *dict;
+
+    ACQUIRE_LOCK(self);
+    dict = Py_BuildValue(
+        "{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:d,s:K,s:I,s:I,s:I}",
+        "at_risk", self->stats.at_risk,
+        "decoder_stream_bytes", self->stats.decoder_stream_bytes,
+        "dynamic_hits", self->stats.dynamic_hits,
+        "encoder_stream_bytes", self->stats.encoder_stream_bytes,
+        "header_block_bytes", self->stats.header_block_bytes,
+        "header_bytes", self->stats.header_bytes,
+        "headers", self->stats.headers,
+        "literals", self->stats.literals,
+        "ratio", (double)lsqpack_enc_ratio(&self->enc),
+        "static_hits", self->stats.static_hits,
+        "table_capacity", self->enc.qpe_cur_max_capacity,
+        "table_entries", self->enc.qpe_nelem,
+        "table_size", self->enc.qpe_cur_bytes_used
+    );
+    RELEASE_LOCK(self);
+
+    return dict;
+}
+
+PyDoc_STRVAR(Encoder_memory_usage__doc__,
+    "memory_usage() -> int\n\n"
+    "Return the number of bytes of memory used by the encoder.\n\n"
+    "This includes the dynamic table, but not the working "
+    "buffers, which encoders only borrow from a shared pool while encoding.\n");
+
+static PyObject*
+Encoder_memory_usage(EncoderObject *self, PyObject *Py_UNUSED(args))
+{
+    size_t size;
+
+    ACQUIRE_LOCK(self);
+    // lsqpack_enc_mem_used() counts the embedded encoder state itself.
+    size = sizeof(*self) - sizeof(self->enc) + lsqpack_enc_mem_used(&self->enc);
+    RELEASE_LOCK(self);
+
+    return PyLong_FromSize_t(size);
+}
+
 static PyMethodDef Encoder_methods[] = {
-    {"apply_settings", (PyCFunction)Encoder_apply_settings, METH_VARARGS | METH_KEYWORDS, Encoder_apply_settings__doc__},
-    {"encode", (PyCFunction)Encoder_encode, METH_VARARGS | METH_KEYWORDS, Encoder_encode__doc__},
-    {"feed_decoder", (PyCFunction)Encoder_feed_decoder, METH_VARARGS | METH_KEYWORDS, Encoder_feed_decoder__doc__},
+    {"apply_settings", (PyCFunction)Encoder_apply_settings, METH_FASTCALL | METH_KEYWORDS, Encoder_apply_settings__doc__},
+    {"cancel_stream", (PyCFunction)Encoder_cancel_stream, METH_FASTCALL | METH_KEYWORDS, Encoder_cancel_stream__doc__},
+    {"encode", (PyCFunction)Encoder_encode, METH_FASTCALL | METH_KEYWORDS, Encoder_encode__doc__},
+    {"encode_many", (PyCFunction)Encoder_encode_many, METH_FASTCALL | METH_KEYWORDS, Encoder_encode_many__doc__},
+    {"feed_decoder", (PyCFunction)Encoder_feed_decoder, METH_FASTCALL | METH_KEYWORDS, Encoder_feed_decoder__doc__},
+    {"memory_usage", (PyCFunction)Encoder_memory_usage, METH_NOARGS, Encoder_memory_usage__doc__},
+    {"prime", (PyCFunction)Encoder_prime, METH_FASTCALL | METH_KEYWORDS, Encoder_prime__doc__},
+    {"set_header_flags", (PyCFunction)Encoder_set_header_flags, METH_FASTCALL | METH_KEYWORDS, Encoder_set_header_flags__doc__},
+    {"set_max_capacity", (PyCFunction)Encoder_set_max_capacity, METH_FASTCALL | METH_KEYWORDS, Encoder_set_max_capacity__doc__},
+    {"stats", (PyCFunction)Encoder_stats, METH_NOARGS, Encoder_stats__doc__},
     {NULL}
 };
 
@@ -601,10 +3501,38 @@ PyInit__binding(void)
     Py_INCREF(EncoderStreamError);
     PyModule_AddObject(m, "EncoderStreamError", EncoderStreamError);
 
+    HeaderValidationError = PyErr_NewException(MODULE_NAME ".HeaderValidationError", PyExc_ValueError, NULL);
+    Py_INCREF(HeaderValidationError);
+    PyModule_AddObject(m, "HeaderValidationError", HeaderValidationError);
+
+    PyModule_AddIntConstant(m, "NO_INDEX", LQEF_NO_INDEX);
+    PyModule_AddIntConstant(m, "NO_HISTORY", LQEF_NO_HIST_UPD);
+    PyModule_AddIntConstant(m, "NO_DYNAMIC", LQEF_NO_DYN);
+    PyModule_AddIntConstant(m, "NEVER_INDEX", ENC_FLAG_NEVER_INDEX);
+
     StreamBlocked = PyErr_NewException(MODULE_NAME ".StreamBlocked", PyExc_ValueError, NULL);
     Py_INCREF(StreamBlocked);
     PyModule_AddObject(m, "StreamBlocked", StreamBlocked);
 
+    if (static_names_init() < 0)
+        return NULL;
+
+    encoder_buffers_pool.lock = PyThread_allocate_lock();
+    if (!encoder_buffers_pool.lock) {
+        PyErr_SetString(PyExc_MemoryError, "unable to allocate lock");
+        return NULL;
+    }
+
+    HeaderListType = PyType_FromSpec(&HeaderListType_spec);
+    if (HeaderListType == NULL)
+        return NULL;
+    PyModule_AddObject(m, "HeaderList", HeaderListType);
+
+    HeaderNameType = PyType_FromSpec(&HeaderNameType_spec);
+    if (HeaderNameType == NULL)
+        return NULL;
+    PyModule_AddObject(m, "HeaderName", HeaderNameType);
+
     DecoderType = PyType_FromSpec(&DecoderType_spec);
     if (DecoderType == NULL)
         return NULL;
@@ -615,5 +3543,10 @@ PyInit__binding(void)
         return NULL;
     PyModule_AddObject(m, "Encoder", EncoderType);
 
+#ifdef Py_GIL_DISABLED
+    // Encoder and Decoder serialize access to their state with a lock.
+    PyUnstable_Module_SetGIL(m, Py_MOD_GIL_NOT_USED);
+#endif
+
     return m;
 }
@@ -52,6 +52,208 @@ class DecoderTest(TestCase):
         # free the decoder
         del decoder
 
+    def test_blocked_stream_many(self):
+        decoder = Decoder(0x100, 0x10)
+        stream_ids = [0, 4, 8]
+
+        # the streams are blocked
+        for stream_id in stream_ids:
+            with self.assertRaises(StreamBlocked):
+                decoder.feed_header(stream_id, binascii.unhexlify("0482d9101112"))
+
+        # the streams become unblocked
+        self.assertEqual(
+            sorted(
+                decoder.feed_encoder(
+                    binascii.unhexlify(
+                        "3fe10168f2b14939d69ce84f8d9635e9ef2a12bd454dc69a659f6cf2b14939d6"
+                        "b505b161cc5a9385198fdad313c696dd6d5f4a082a65b6850400bea0837190dc"
+                        "138a62d1bf"
+                    )
+                )
+            ),
+            stream_ids,
+        )
+
+        # the streams are only reported once
+        self.assertEqual(decoder.feed_encoder(b""), [])
+
+        # the headers are resumed
+        for stream_id in stream_ids:
+            control, headers = decoder.resume_header(stream_id)
+            self.assertEqual(len(headers), 4)
+
+        # the header blocks are gone
+        for stream_id in stream_ids:
+            with self.assertRaises(ValueError):
+                decoder.resume_header(stream_id)
+
+    def test_blocked_stream_sink(self):
+        received = []
+        decoder = Decoder(0x100, 0x10, sink=lambda *args: received.append(args))
+
+        # the streams are blocked, without raising
+        for stream_id in [0, 4]:
+            self.assertIsNone(
+                decoder.feed_header(stream_id, binascii.unhexlify("0482d9101112"))
+            )
+        self.assertEqual(received, [])
+
+        # the streams are unblocked and passed to the sink
+        self.assertEqual(
+            decoder.feed_encoder(
+                binascii.unhexlify(
+                    "3fe10168f2b14939d69ce84f8d9635e9ef2a12bd454dc69a659f6cf2b14939d6"
+                    "b505b161cc5a9385198fdad313c696dd6d5f4a082a65b6850400bea0837190dc"
+                    "138a62d1bf"
+                )
+            ),
+            [],
+        )
+        self.assertEqual(sorted(args[0] for args in received), [0, 4])
+        for stream_id, control, headers in received:
+            self.assertEqual(control, b"\x80" if stream_id == 0 else b"\x84")
+            self.assertEqual(headers[0], (b":status", b"200"))
+
+        # an unblocked stream is passed to the sink straight away
+        self.assertIsNone(decoder.feed_header(8, binascii.unhexlify("0482d9101112")))
+        self.assertEqual(received[-1][0], 8)
+
+    def test_sink_error(self):
+        def sink(stream_id, control, headers):
+            raise RuntimeError("sink failed for stream %d" % stream_id)
+
+        decoder = Decoder(0x100, 0x10, sink=sink)
+        with self.assertRaises(RuntimeError) as cm:
+            decoder.feed_header(0, binascii.unhexlify("0000d1"))
+        self.assertEqual(str(cm.exception), "sink failed for stream 0")
+
+        with self.assertRaises(TypeError) as cm:
+            Decoder(0x100, 0x10, sink=1)
+        self.assertEqual(str(cm.exception), "sink must be callable")
+
+    def test_blocked_stream_chunks(self):
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+        data = binascii.unhexlify("0482d9101112")
+
+        # the stream is blocked, but the header block is incomplete
+        self.assertIsNone(decoder.feed_header_chunk(stream_id, data[:2], len(data)))
+
+        # the header block is complete
+        with self.assertRaises(StreamBlocked):
+            decoder.feed_header_chunk(stream_id, data[2:], len(data))
+
+        # the stream becomes unblocked
+        self.assertEqual(
+            decoder.feed_encoder(
+                binascii.unhexlify(
+                    "3fe10168f2b14939d69ce84f8d9635e9ef2a12bd454dc69a659f6cf2b14939d6"
+                    "b505b161cc5a9385198fdad313c696dd6d5f4a082a65b6850400bea0837190dc"
+                    "138a62d1bf"
+                )
+            ),
+            [stream_id],
+        )
+
+        # the header is resumed
+        control, headers = decoder.resume_header(stream_id)
+        self.assertEqual(control, b"\x80")
+        self.assertEqual(len(headers), 4)
+
+    def test_blocked_stream_chunks_unblocked_early(self):
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+        data = binascii.unhexlify("0482d9101112")
+
+        self.assertIsNone(decoder.feed_header_chunk(stream_id, data[:2], len(data)))
+
+        # the stream is not reported, as its header block is incomplete
+        self.assertEqual(
+            decoder.feed_encoder(
+                binascii.unhexlify(
+                    "3fe10168f2b14939d69ce84f8d9635e9ef2a12bd454dc69a659f6cf2b14939d6"
+                    "b505b161cc5a9385198fdad313c696dd6d5f4a082a65b6850400bea0837190dc"
+                    "138a62d1bf"
+                )
+            ),
+            [],
+        )
+        with self.assertRaises(ValueError) as cm:
+            decoder.resume_header(stream_id)
+        self.assertEqual(
+            str(cm.exception), "the header block for stream 0 is incomplete"
+        )
+
+        # the last chunk completes decoding
+        control, headers = decoder.feed_header_chunk(stream_id, data[2:], len(data))
+        self.assertEqual(control, b"\x80")
+        self.assertEqual(len(headers), 4)
+
+    def test_chunk_too_long(self):
+        decoder = Decoder(0x100, 0x10)
+        with self.assertRaises(ValueError) as cm:
+            decoder.feed_header_chunk(0, b"\x00\x00\xd1", 2)
+        self.assertEqual(
+            str(cm.exception), "the data exceeds the size of the header block"
+        )
+
+    def test_cancel_stream(self):
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+
+        # the stream is blocked
+        with self.assertRaises(StreamBlocked):
+            decoder.feed_header(stream_id, binascii.unhexlify("0482d9101112"))
+        self.assertEqual(decoder.stats()["pending_blocks"], 1)
+
+        # resuming the still blocked stream does not count it again
+        with self.assertRaises(StreamBlocked):
+            decoder.resume_header(stream_id)
+        self.assertEqual(decoder.stats()["blocked"], 1)
+
+        # the stream is cancelled
+        self.assertEqual(decoder.cancel_stream(stream_id), b"\x40")
+        self.assertEqual(decoder.stats()["pending_blocks"], 0)
+
+        # the header block is gone
+        with self.assertRaises(ValueError):
+            decoder.resume_header(stream_id)
+
+    def test_cancel_stream_unknown(self):
+        decoder = Decoder(0x100, 0x10)
+        self.assertEqual(decoder.cancel_stream(4), b"\x44")
+        self.assertEqual(decoder.cancel_stream(100), b"\x7f\x25")
+
+        # without a dynamic table there is nothing to cancel
+        decoder = Decoder(0, 0)
+        self.assertEqual(decoder.cancel_stream(4), b"")
+        self.assertEqual(decoder.stats()["decoder_stream_bytes"], 0)
+
+    def test_init_twice(self):
+        decoder = Decoder(0x100, 0x10)
+        with self.assertRaises(RuntimeError) as cm:
+            decoder.__init__(0x100, 0x10)
+        self.assertEqual(str(cm.exception), "the decoder is already initialized")
+
+    def test_stats_table(self):
+        decoder = Decoder(0x100, 0x10)
+        stats = decoder.stats()
+        self.assertEqual(stats["table_capacity"], 0)
+        self.assertEqual(stats["table_size"], 0)
+
+        # set the capacity and insert four entries
+        decoder.feed_encoder(
+            binascii.unhexlify(
+                "3fe10168f2b14939d69ce84f8d9635e9ef2a12bd454dc69a659f6cf2b14939d6"
+                "b505b161cc5a9385198fdad313c696dd6d5f4a082a65b6850400bea0837190dc"
+                "138a62d1bf"
+            )
+        )
+        stats = decoder.stats()
+        self.assertEqual(stats["table_capacity"], 0x100)
+        self.assertGreater(stats["table_size"], 0)
+
     def test_blocked_stream_free(self):
         decoder = Decoder(0x100, 0x10)
         stream_id = 0
@@ -1,15 +1,93 @@
 from unittest import TestCase
 
-from pylsqpack import DecoderStreamError, Encoder
+from pylsqpack import DecoderStreamError, Encoder, HeaderValidationError
 
 
 class EncoderTest(TestCase):
+    def test_apply_settings_dynamic_table_capacity(self):
+        encoder = Encoder()
+        tsu = encoder.apply_settings(0x100, 0x10, dynamic_table_capacity=0x80)
+        self.assertEqual(tsu, b"\x3f\x61")
+
+    def test_apply_settings_overflow(self):
+        encoder = Encoder()
+        with self.assertRaises(OverflowError):
+            encoder.apply_settings(0x100, 0x10, dynamic_table_capacity=2**32 + 0x80)
+        with self.assertRaises(OverflowError):
+            encoder.apply_settings(2**32 + 0x100, 0x10)
+        with self.assertRaises(OverflowError):
+            encoder.apply_settings(0x100, -1)
+        with self.assertRaises(TypeError):
+            encoder.apply_settings(0x100, 0x10, dynamic_table_capacity="0x80")
+
+    def test_apply_settings_dynamic_table_capacity_too_large(self):
+        encoder = Encoder()
+        with self.assertRaises(ValueError) as cm:
+            encoder.apply_settings(0x100, 0x10, dynamic_table_capacity=0x200)
+        self.assertEqual(
+            str(cm.exception),
+            "dynamic_table_capacity must not exceed max_table_capacity",
+        )
+
     def test_decoder_stream_error(self):
         encoder = Encoder()
         with self.assertRaises(DecoderStreamError) as cm:
             encoder.feed_decoder(b"\x00")
         self.assertEqual(str(cm.exception), "lsqpack_enc_decoder_in failed")
 
+    def test_init_twice(self):
+        encoder = Encoder()
+        with self.assertRaises(RuntimeError) as cm:
+            encoder.__init__()
+        self.assertEqual(str(cm.exception), "the encoder is already initialized")
+
+    def test_set_max_capacity(self):
+        encoder = Encoder()
+        encoder.apply_settings(0x100, 0x10)
+        self.assertEqual(encoder.set_max_capacity(0x80), b"\x3f\x61")
+
+    def test_set_header_flags_invalid(self):
+        encoder = Encoder()
+        with self.assertRaises(ValueError) as cm:
+            encoder.set_header_flags(b"foo", 0x100)
+        self.assertEqual(str(cm.exception), "invalid encoding flags")
+
+    def test_encode_arguments(self):
+        encoder = Encoder()
+        self.assertEqual(
+            encoder.encode(stream_id=0, headers=[(b"one", b"foo")]),
+            encoder.encode(0, [(b"one", b"foo")]),
+        )
+
+        with self.assertRaises(TypeError) as cm:
+            encoder.encode(0)
+        self.assertEqual(
+            str(cm.exception), "encode() missing required argument 'headers' (pos 2)"
+        )
+
+        with self.assertRaises(TypeError) as cm:
+            encoder.encode(0, [], None)
+        self.assertEqual(
+            str(cm.exception),
+            "encode() takes at most 2 positional arguments (3 given)",
+        )
+
+        with self.assertRaises(TypeError) as cm:
+            encoder.encode(0, [], foo=1)
+        self.assertEqual(
+            str(cm.exception), "encode() got an unexpected keyword argument 'foo'"
+        )
+
+        with self.assertRaises(TypeError) as cm:
+            encoder.encode(0, [], stream_id=0)
+        self.assertEqual(
+            str(cm.exception), "encode() got multiple values for argument 'stream_id'"
+        )
+
+        with self.assertRaises(TypeError) as cm:
+            encoder.encode("0", [])
+        self.assertEqual(str(cm.exception), "stream_id must be an integer")
+
     def test_encode_not_a_tuple(self):
         encoder = Encoder()
         stream_id = 0
@@ -38,9 +116,70 @@ class EncoderTest(TestCase):
             encoder.encode(stream_id, [(b"foo", 1)])
         self.assertEqual(str(cm.exception), "the header's name and value must be bytes")
 
+    def test_encode_str_not_ascii(self):
+        encoder = Encoder()
+        stream_id = 0
+        with self.assertRaises(ValueError) as cm:
+            encoder.encode(stream_id, [("foo", "bär")])
+        self.assertEqual(str(cm.exception), "the header's name and value must be ASCII")
+
     def test_encode_too_long(self):
         encoder = Encoder()
         stream_id = 0
         with self.assertRaises(ValueError) as cm:
-            encoder.encode(stream_id, [(bytes(4096), bytes(1))])
+            encoder.encode(stream_id, [(bytes(65535), bytes(1))])
         self.assertEqual(str(cm.exception), "the header's name and value are too long")
+
+    def test_encode_validate_headers(self):
+        encoder = Encoder()
+        long = b"x" * 40
+
+        # valid headers are encoded
+        encoder.encode(
+            0,
+            [(b":method", b"GET"), (b"x-" + long, long + b" " + long)],
+            validate_headers=True,
+        )
+
+        for headers, message in [
+            ([(b"X-Foo", b"bar")], "header 0: invalid name"),
+            ([(long + b"A", b"bar")], "header 0: invalid name"),
+            ([(long + b"\xff", b"bar")], "header 0: invalid name"),
+            ([(b"x foo", b"bar")], "header 0: invalid name"),
+            ([(b"x:foo", b"bar")], "header 0: invalid name"),
+            ([(b":", b"bar")], "header 0: invalid name"),
+            (
+                [(b"x-foo", b" bar")],
+                "header 0: leading or trailing whitespace in value",
+            ),
+            (
+                [(b"x-foo", b"bar\t")],
+                "header 0: leading or trailing whitespace in value",
+            ),
+            ([(b"x-foo", long + b"\r\n")], "header 0: forbidden character in value"),
+            ([(b"x-foo", b"b\x00r")], "header 0: forbidden character in value"),
+            (
+                [(b"x-foo", b"bar"), (b":path", b"/")],
+                "header 1: pseudo-header after a regular header",
+            ),
+        ]:
+            with self.assertRaises(HeaderValidationError) as cm:
+                encoder.encode(0, headers, validate_headers=True)
+            self.assertEqual(str(cm.exception), message)
+
+        # headers are not validated by default
+        encoder.encode(0, [(b"X-Foo", b"bar")])
+
+    def test_encode_many_not_a_tuple(self):
+        encoder = Encoder()
+        with self.assertRaises(ValueError) as cm:
+            encoder.encode_many([(0, [(b"foo", b"bar")]), [b"hello"]])
+        self.assertEqual(
+            str(cm.exception), "the item must be a (stream_id, headers) tuple"
+        )
+
+    def test_encode_many_invalid_headers(self):
+        encoder = Encoder()
+        with self.assertRaises(ValueError) as cm:
+            encoder.encode_many([(0, [(b"foo", b"bar")]), (4, [(b"", b"bar")])])
+        self.assertEqual(str(cm.exception), "the header's name must not be empty")
@@ -1,6 +1,16 @@
+import threading
 from unittest import TestCase
 
-from pylsqpack import Decoder, Encoder
+from pylsqpack import (
+    NEVER_INDEX,
+    NO_INDEX,
+    Decoder,
+    Encoder,
+    HeaderList,
+    HeaderName,
+    HeaderValidationError,
+    StreamBlocked,
+)
 
 
 class RoundtripTest(TestCase):
@@ -14,11 +24,543 @@ class RoundtripTest(TestCase):
         self.assertEqual(control, b"")
         self.assertEqual(data, b"\x00\x00*=E\x82\x94\xe7#two\x03bar")
 
+        # decode headers from various bytes-like objects
+        self.assertEqual(decoder.feed_encoder(bytearray(control)), [])
+        control, headers = decoder.feed_header(stream_id, bytearray(data))
+        self.assertEqual(control, b"")
+        self.assertEqual(headers, [(b"one", b"foo"), (b"two", b"bar")])
+        control, headers = decoder.feed_header_chunk(
+            stream_id + 4, memoryview(data), len(data)
+        )
+        self.assertEqual(headers, [(b"one", b"foo"), (b"two", b"bar")])
+        encoder.feed_decoder(memoryview(control))
+
+    def test_aggressive_indexing(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+
+        # apply decoder settings
+        encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+
+        # the headers are inserted into the dynamic table straight away
+        headers = [(b"one", b"foo"), (b"two", b"bar")]
+        control, data = encoder.encode(stream_id, headers)
+        self.assertNotEqual(control, b"")
+
         # decode headers
         decoder.feed_encoder(control)
-        control, headers = decoder.feed_header(stream_id, data)
+        control, decoded = decoder.feed_header(stream_id, data)
+        self.assertEqual(decoded, headers)
+
+    def test_bytes_like(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+
+        # encode headers from various bytes-like objects
+        buf = bytearray(b"two: bar")
+        control, data = encoder.encode(
+            stream_id,
+            [
+                ("one", bytearray(b"foo")),
+                (memoryview(buf)[0:3], memoryview(buf)[5:]),
+            ],
+        )
+        self.assertEqual(control, b"")
+        self.assertEqual(data, b"\x00\x00*=E\x82\x94\xe7#two\x03bar")
+
+        # decode headers from various bytes-like objects
+        self.assertEqual(decoder.feed_encoder(bytearray(control)), [])
+        control, headers = decoder.feed_header(stream_id, bytearray(data))
         self.assertEqual(control, b"")
         self.assertEqual(headers, [(b"one", b"foo"), (b"two", b"bar")])
+        control, headers = decoder.feed_header_chunk(
+            stream_id + 4, memoryview(data), len(data)
+        )
+        self.assertEqual(headers, [(b"one", b"foo"), (b"two", b"bar")])
+        encoder.feed_decoder(memoryview(control))
+
+    def test_cancel_stream(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+
+        # apply decoder settings
+        encoder.apply_settings(0x100, 0x10)
+
+        # populate the dynamic table
+        headers = [(b"one", b"foo"), (b"two", b"bar")]
+        for stream_id in [0, 4]:
+            control, data = encoder.encode(stream_id, headers)
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id, data)
+            encoder.feed_decoder(control)
+
+        # the header block for stream 8 is never sent
+        control, data = encoder.encode(8, headers)
+        decoder.feed_encoder(control)
+        encoder.cancel_stream(8)
+
+        # the decoder cancels a stream it never received
+        encoder.feed_decoder(decoder.cancel_stream(12))
+
+        # encoding carries on
+        control, data = encoder.encode(16, headers)
+        decoder.feed_encoder(control)
+        control, decoded = decoder.feed_header(16, data)
+        self.assertEqual(decoded, headers)
+
+    def test_coalesce_decoder_stream(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10, coalesce_decoder_stream=True)
+        encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+
+        # the Section Acknowledgments are held back
+        headers = [(b"one", b"foo")]
+        for stream_id in [0, 4]:
+            control, data = encoder.encode(stream_id, headers)
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id, data)
+            self.assertEqual(control, b"")
+            self.assertEqual(decoded, headers)
+        self.assertEqual(decoder.cancel_stream(8), b"")
+
+        # they are flushed at once
+        self.assertEqual(decoder.flush_decoder_stream(), b"\x80\x84\x48")
+        self.assertEqual(decoder.flush_decoder_stream(), b"")
+
+        # an insertion without a Section Acknowledgment is acknowledged too
+        control, data = encoder.encode(12, [(b"two", b"bar")])
+        self.assertNotEqual(control, b"")
+        decoder.feed_encoder(control)
+        control = decoder.flush_decoder_stream()
+        self.assertEqual(control, b"\x01")
+        encoder.feed_decoder(control)
+
+    def test_encode_many(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+
+        # apply decoder settings
+        encoder.apply_settings(0x100, 0x10)
+
+        # encode headers for several streams
+        items = [
+            (0, [(b"one", b"foo"), (b"two", b"bar")]),
+            (4, [(b"one", b"foo"), (b"two", b"bar")]),
+            (8, [(b"three", b"baz")]),
+        ]
+        control, blocks = encoder.encode_many(items)
+        self.assertEqual(len(blocks), 3)
+
+        # decode headers
+        decoder.feed_encoder(control)
+        for (stream_id, headers), data in zip(items, blocks):
+            _, decoded = decoder.feed_header(stream_id, data)
+            self.assertEqual(decoded, headers)
+
+    def test_header_chunks(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+
+        headers = [(b"x-header-%d" % i, b"value %d" % i) for i in range(50)]
+        control, data = encoder.encode(stream_id, headers)
+        decoder.feed_encoder(control)
+
+        # the header block is decoded as it arrives
+        for i in range(0, len(data) - 10, 10):
+            result = decoder.feed_header_chunk(stream_id, data[i : i + 10], len(data))
+            self.assertIsNone(result)
+        control, decoded = decoder.feed_header_chunk(
+            stream_id, data[i + 10 :], len(data)
+        )
+        self.assertEqual(control, b"")
+        self.assertEqual(decoded, headers)
+
+    def test_http1_headers(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10, http1_headers=True)
+        stream_id = 0
+
+        # encode headers
+        headers = [
+            (b":method", b"GET"),
+            (b":path", b"/"),
+            (b"accept", b"*/*"),
+            (b"x-empty", b""),
+        ]
+        control, data = encoder.encode(stream_id, headers)
+
+        # decode headers
+        decoder.feed_encoder(control)
+        control, decoded = decoder.feed_header(stream_id, data)
+        self.assertEqual(
+            decoded,
+            ([(b":method", b"GET"), (b":path", b"/")], b"accept: */*\r\nx-empty: \r\n"),
+        )
+
+        # header values which would split the HTTP/1.x line are rejected
+        encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+        control, data = encoder.encode(4, [(b"x-bad", b"foo\r\nbar: baz")])
+        decoder.feed_encoder(control)
+        with self.assertRaises(HeaderValidationError) as cm:
+            decoder.feed_header(4, data)
+        self.assertEqual(str(cm.exception), "header 0 cannot be formatted for HTTP/1.x")
+
+        # the header block is still acknowledged
+        self.assertNotEqual(cm.exception.control, b"")
+        encoder.feed_decoder(cm.exception.control)
+        self.assertEqual(
+            encoder.stats()["decoder_stream_bytes"], len(cm.exception.control)
+        )
+
+        with self.assertRaises(ValueError):
+            Decoder(0x100, 0x10, http1_headers=True, lazy_headers=True)
+
+    def test_lazy_headers(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10, lazy_headers=True)
+        stream_id = 0
+
+        # encode headers
+        headers = [(b":method", b"GET"), (b"one", b"foo"), (b"two", b"bar")]
+        control, data = encoder.encode(stream_id, headers)
+
+        # decode headers
+        decoder.feed_encoder(control)
+        control, decoded = decoder.feed_header(stream_id, data)
+        self.assertIsInstance(decoded, HeaderList)
+        self.assertEqual(decoded, headers)
+        self.assertEqual(len(decoded), 3)
+        self.assertEqual(decoded[1], (b"one", b"foo"))
+        self.assertEqual(decoded[-1], (b"two", b"bar"))
+        self.assertEqual(decoded[1:], headers[1:])
+        self.assertEqual(list(decoded), headers)
+        with self.assertRaises(IndexError):
+            decoded[3]
+
+        # static table names are shared
+        self.assertIs(decoded[0][0], decoded[0][0])
+
+    def test_header_flags(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+
+        # apply decoder settings
+        encoder.apply_settings(0x100, 0x10)
+        encoder.set_header_flags(b"one", NO_INDEX)
+        encoder.set_header_flags(b"authorization", NEVER_INDEX)
+
+        headers = [(b"one", b"foo"), (b"two", b"bar"), (b"authorization", b"secret")]
+        for i in range(3):
+            control, data = encoder.encode(stream_id, headers)
+
+            # "one: foo" is never inserted into the dynamic table
+            self.assertNotIn(b"=E\x82\x94\xe7", control)
+
+            # decode headers
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id, data)
+            self.assertEqual(decoded, headers)
+
+        # restore the default behaviour
+        encoder.set_header_flags(b"one", 0)
+        control, data = encoder.encode(stream_id, headers)
+        self.assertIn(b"=E\x82\x94\xe7", control)
+
+    def test_header_names(self):
+        headers = [
+            (b":method", b"GET"),
+            (b":status", b"500"),
+            (b"content-type", b"text/x-custom"),
+            (b"x-custom", b"foo"),
+        ]
+        names = [(HeaderName(name), value) for name, value in headers]
+        self.assertEqual(repr(names[0][0]), "HeaderName(b':method')")
+        self.assertEqual(names[0][0].name, b":method")
+
+        # other bytes-like names and ASCII strings are kept as bytes
+        for name in [bytearray(b"x-custom"), memoryview(b"x-custom"), "x-custom"]:
+            self.assertEqual(HeaderName(name).name, b"x-custom")
+        with self.assertRaises(ValueError):
+            HeaderName("x-cust\xf6m")
+        with self.assertRaises(TypeError):
+            HeaderName(1)
+
+        # the hints do not change the encoding
+        encoder = Encoder()
+        encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+        hinted_encoder = Encoder()
+        hinted_encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+        decoder = Decoder(0x100, 0x10)
+        for stream_id in range(3):
+            expected = encoder.encode(stream_id * 4, headers)
+            control, data = hinted_encoder.encode(stream_id * 4, names)
+            self.assertEqual((control, data), expected)
+
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id * 4, data)
+            self.assertEqual(decoded, headers)
+
+    def test_large_headers(self):
+        encoder = Encoder()
+        decoder = Decoder(0x1000, 0x10)
+        stream_id = 0
+
+        # apply decoder settings
+        encoder.apply_settings(0x1000, 0x10)
+
+        # the header block and encoder stream exceed the initial buffer sizes
+        headers = [
+            (b"cookie", b"a" * 10000),
+            (b"content-security-policy", b"b" * 5000),
+        ] + [(b"x-header-%d" % i, b"c" * 500) for i in range(20)]
+
+        for i in range(2):
+            control, data = encoder.encode(stream_id, headers)
+
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id, data)
+            self.assertEqual(decoded, headers)
+
+    def test_many_blocks(self):
+        encoder = Encoder()
+        decoder = Decoder(0x1000, 0x10)
+        encoder.apply_settings(0x1000, 0x10)
+
+        # header blocks of different sizes reuse the decoder's buffers
+        for i in range(40):
+            stream_id = i * 4
+            if i % 3:
+                headers = [(b"x-small", b"%d" % i)]
+            else:
+                headers = [(b"x-large-%d" % j, b"v" * 5000) for j in range(20)]
+
+            control, data = encoder.encode(stream_id, headers)
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id, data)
+            encoder.feed_decoder(control)
+            self.assertEqual(decoded, headers)
+
+    def test_memory_usage(self):
+        encoder = Encoder()
+        decoder = Decoder(0x1000, 0x10)
+        encoder.apply_settings(0x1000, 0x10, aggressive_indexing=True)
+        encoder_usage = encoder.memory_usage()
+        decoder_usage = decoder.memory_usage()
+        self.assertGreater(encoder_usage, 0)
+        self.assertGreater(decoder_usage, 0)
+
+        # the dynamic table is counted
+        for stream_id in range(10):
+            headers = [(b"x-header-%d" % stream_id, b"x" * 100)]
+            control, data = encoder.encode(stream_id * 4, headers)
+            decoder.feed_encoder(control)
+            control, decoded = decoder.feed_header(stream_id * 4, data)
+            encoder.feed_decoder(control)
+        self.assertGreater(encoder.memory_usage(), encoder_usage + 1000)
+        self.assertGreater(decoder.memory_usage(), decoder_usage + 1000)
+
+    def test_no_blocking(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+        encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+        headers = [(b"one", b"foo"), (b"two", b"bar")]
+
+        # the header block references a new entry, so it could block
+        blocked_control, blocked_data, at_risk = encoder.encode(
+            0, [(b"one", b"foo")], report_at_risk=True
+        )
+        self.assertNotEqual(blocked_control, b"")
+        self.assertTrue(at_risk)
+
+        # without blocking, the header blocks do not use the dynamic table,
+        # although other streams and the same stream are already at risk
+        for stream_id in [4, 0]:
+            control, data, at_risk = encoder.encode(
+                stream_id, headers, allow_blocking=False, report_at_risk=True
+            )
+            self.assertEqual(control, b"")
+            self.assertEqual(data[:2], b"\x00\x00")
+            self.assertFalse(at_risk)
+            _, decoded = Decoder(0x100, 0x10).feed_header(stream_id, data)
+            self.assertEqual(decoded, headers)
+
+        # the same applies to encode_many
+        control, blocks = encoder.encode_many(
+            [(8, headers), (12, headers)], allow_blocking=False
+        )
+        self.assertEqual(control, b"")
+        for stream_id, data in zip([8, 12], blocks):
+            self.assertEqual(data[:2], b"\x00\x00")
+            _, decoded = decoder.feed_header(stream_id, data)
+            self.assertEqual(decoded, headers)
+
+        # the first stream is unblocked by the encoder stream data
+        with self.assertRaises(StreamBlocked):
+            decoder.feed_header(0, blocked_data)
+        self.assertEqual(decoder.feed_encoder(blocked_control), [0])
+        _, decoded = decoder.resume_header(0)
+        self.assertEqual(decoded, [(b"one", b"foo")])
+
+    def test_prime(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 1)
+        decoder.feed_encoder(encoder.apply_settings(0x100, 1))
+
+        # prime the dynamic table
+        headers = [(b"one", b"foo"), (b"two", b"bar")]
+        control = encoder.prime(headers)
+        self.assertNotEqual(control, b"")
+        decoder.feed_encoder(control)
+        stats = encoder.stats()
+        self.assertEqual(stats["at_risk"], 0)
+        self.assertEqual(stats["encoder_stream_bytes"], len(control))
+        self.assertEqual(stats["header_block_bytes"], 0)
+        self.assertEqual(stats["headers"], 0)
+        self.assertEqual(stats["table_entries"], 2)
+
+        # the priming blocks hold no references, so the only stream allowed
+        # at risk can reference the entries before they are acknowledged
+        control, data, at_risk = encoder.encode(0, headers, report_at_risk=True)
+        self.assertEqual(control, b"")
+        self.assertTrue(at_risk)
+        control, decoded = decoder.feed_header(0, data)
+        self.assertEqual(decoded, headers)
+        encoder.feed_decoder(control)
+        stats = encoder.stats()
+        self.assertEqual(stats["dynamic_hits"], 2)
+        self.assertEqual(stats["literals"], 0)
+
+    def test_stats(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10)
+        stream_id = 0
+
+        # apply decoder settings
+        encoder.apply_settings(0x100, 0x10)
+
+        encoder_stream_bytes = 0
+        decoder_stream_bytes = 0
+        header_block_bytes = 0
+        for i in range(3):
+            control, data = encoder.encode(
+                stream_id, [(b"one", b"foo"), (b"two", b"bar")]
+            )
+            encoder_stream_bytes += len(control)
+            header_block_bytes += len(data)
+
+            decoder.feed_encoder(control)
+            control, headers = decoder.feed_header(stream_id, data)
+            decoder_stream_bytes += len(control)
+            encoder.feed_decoder(control)
+
+        stats = encoder.stats()
+        self.assertEqual(stats["headers"], 6)
+        self.assertEqual(stats["header_bytes"], 36)
+        self.assertEqual(stats["static_hits"], 0)
+        self.assertEqual(stats["dynamic_hits"], 4)
+        self.assertEqual(stats["literals"], 2)
+        self.assertEqual(stats["encoder_stream_bytes"], encoder_stream_bytes)
+        self.assertEqual(stats["decoder_stream_bytes"], decoder_stream_bytes)
+        self.assertEqual(stats["header_block_bytes"], header_block_bytes)
+        self.assertEqual(stats["table_capacity"], 0x100)
+        self.assertEqual(stats["table_entries"], 2)
+        self.assertEqual(stats["table_size"], 76)
+
+        stats = decoder.stats()
+        self.assertEqual(stats["blocked"], 0)
+        self.assertEqual(stats["headers"], 6)
+        self.assertEqual(stats["header_bytes"], 36)
+        self.assertEqual(stats["encoder_stream_bytes"], encoder_stream_bytes)
+        self.assertEqual(stats["decoder_stream_bytes"], decoder_stream_bytes)
+        self.assertEqual(stats["header_block_bytes"], header_block_bytes)
+        self.assertEqual(stats["pending_blocks"], 0)
+        self.assertEqual(stats["table_size"], 76)
+
+    def test_threads(self):
+        # one encoder using the dynamic table and one decoder shared by all threads
+        encoder = Encoder()
+        decoder = Decoder(0x1000, 0x10)
+        encoder.apply_settings(0x1000, 0x10)
+        encoder_stream_lock = threading.Lock()
+        errors = []
+
+        def worker(worker_id):
+            try:
+                for i in range(50):
+                    stream_id = (worker_id * 50 + i) * 4
+                    headers = [
+                        (b"x-worker", b"%d" % worker_id),
+                        (b"x-payload", b"%d" % (i % 5) * 100),
+                    ]
+
+                    # the encoder stream must reach the decoder in order
+                    with encoder_stream_lock:
+                        control, data = encoder.encode(stream_id, headers)
+                        decoder.feed_encoder(control)
+
+                    control, decoded = decoder.feed_header(stream_id, data)
+                    self.assertEqual(decoded, headers)
+                    encoder.feed_decoder(control)
+            except Exception as exc:
+                errors.append(exc)
+
+        threads = [threading.Thread(target=worker, args=(i,)) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+
+        encoder_stats = encoder.stats()
+        decoder_stats = decoder.stats()
+        self.assertEqual(encoder_stats["headers"], 400)
+        self.assertGreater(encoder_stats["dynamic_hits"], 0)
+        self.assertEqual(decoder_stats["blocked"], 0)
+        self.assertEqual(decoder_stats["pending_blocks"], 0)
+        for key in [
+            "decoder_stream_bytes",
+            "encoder_stream_bytes",
+            "header_block_bytes",
+            "header_bytes",
+            "headers",
+            "table_size",
+        ]:
+            self.assertEqual(encoder_stats[key], decoder_stats[key], key)
+
+    def test_validate_headers(self):
+        encoder = Encoder()
+        decoder = Decoder(0x100, 0x10, validate_headers=True)
+
+        # valid headers are decoded
+        headers = [(b":method", b"GET"), (b"x-foo", b"bar")]
+        control, data = encoder.encode(0, headers)
+        decoder.feed_encoder(control)
+        control, decoded = decoder.feed_header(0, data)
+        self.assertEqual(decoded, headers)
+
+        # invalid headers are rejected
+        control, data = encoder.encode(4, [(b"X-Foo", b"bar")])
+        decoder.feed_encoder(control)
+        with self.assertRaises(HeaderValidationError) as cm:
+            decoder.feed_header(4, data)
+        self.assertEqual(str(cm.exception), "header 0 of stream 4: invalid name")
+        self.assertEqual(cm.exception.control, b"")
+
+        # the header block is still acknowledged
+        encoder.apply_settings(0x100, 0x10, aggressive_indexing=True)
+        control, data = encoder.encode(8, [(b"X-Bar", b"baz")])
+        decoder.feed_encoder(control)
+        with self.assertRaises(HeaderValidationError) as cm:
+            decoder.feed_header(8, data)
+        self.assertNotEqual(cm.exception.control, b"")
+        encoder.feed_decoder(cm.exception.control)
+        self.assertEqual(
+            encoder.stats()["decoder_stream_bytes"], len(cm.exception.control)
+        )
 
     def test_with_settings(self):
         encoder = Encoder()
@@ -36,11 +578,16 @@ class RoundtripTest(TestCase):
         self.assertEqual(control, b"")
         self.assertEqual(data, b"\x00\x00*=E\x82\x94\xe7#two\x03bar")
 
-        # decode headers
-        decoder.feed_encoder(control)
-        control, headers = decoder.feed_header(stream_id, data)
+        # decode headers from various bytes-like objects
+        self.assertEqual(decoder.feed_encoder(bytearray(control)), [])
+        control, headers = decoder.feed_header(stream_id, bytearray(data))
         self.assertEqual(control, b"")
         self.assertEqual(headers, [(b"one", b"foo"), (b"two", b"bar")])
+        control, headers = decoder.feed_header_chunk(
+            stream_id + 4, memoryview(data), len(data)
+        )
+        self.assertEqual(headers, [(b"one", b"foo"), (b"two", b"bar")])
+        encoder.feed_decoder(memoryview(control))
 
         # ROUND 2
 